@@ -0,0 +1,185 @@
+#include "adaptive_codec.hpp"
+#include "histogram.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+adaptive_model::adaptive_model(adaptive_options options): _options(options) {
+    _counts.fill(1);
+    _total = _counts.size();
+    _interval = std::min(adaptive_options::MIN_REBUILD_INTERVAL, options.rebuild_interval);
+    _until_rebuild = _interval;
+    _codes = make_canonical_codes(build_code_lengths(_counts, options.max_code_length));
+}
+
+void adaptive_model::update(const uint8_t *data, size_t size) {
+    accumulate_histogram(data, size, _counts);
+    _total += size;
+    _until_rebuild -= size;
+    if (_until_rebuild == 0)
+        rebuild();
+}
+
+void adaptive_model::rebuild() {
+    if (_total > AGING_LIMIT) {
+        _total = 0;
+        for (auto &count : _counts) {
+            count = (count + 1) / 2;
+            _total += count;
+        }
+    }
+
+    _codes = make_canonical_codes(build_code_lengths(_counts, _options.max_code_length));
+    _is_table_stale = true;
+    _interval = std::min(_interval * 2, _options.rebuild_interval);
+    _until_rebuild = _interval;
+}
+
+const decode_table &adaptive_model::table() {
+    if (_is_table_stale) {
+        _table = decode_table(_codes);
+        _is_table_stale = false;
+    }
+    return _table;
+}
+
+namespace {
+    adaptive_options checked_options(adaptive_options options) {
+        if (options.rebuild_interval == 0)
+            throw std::invalid_argument("rebuild interval must be positive");
+        validate_code_length_limit(options.max_code_length);
+        return options;
+    }
+}
+
+adaptive_encoder::adaptive_encoder(adaptive_options options)
+    : options(checked_options(options)), _model(options) {
+}
+
+void adaptive_encoder::write_header(std::ostream &output_stream) {
+    bit_writer writer(output_stream, stats);
+    writer.write_header(format_version::adaptive);
+    writer.write_varint(options.rebuild_interval);
+    writer.write_varint(options.max_code_length);
+}
+
+// Every frame is byte aligned, the codes carry over from one frame to the next.
+void adaptive_encoder::write_frame(const uint8_t *data, size_t size, std::ostream &output_stream) {
+    _payload.clear();
+    word_bit_writer writer(_payload);
+    for (const auto *end = data + size; data != end;) {
+        const auto count = static_cast<size_t>(std::min<uint64_t>(end - data, _model.until_rebuild()));
+        const auto &codes = _model.codes();
+        for (const auto *segment_end = data + count; data != segment_end; ++data)
+            writer.write(codes[*data]);
+        _model.update(data - count, count);
+    }
+    writer.finish();
+
+    bit_writer frame_writer(output_stream, stats);
+    frame_writer.write_varint(size);
+    frame_writer.write_varint(_payload.size());
+    output_stream.write(reinterpret_cast<const char *>(_payload.data()), _payload.size());
+
+    stats.input_file_size += size;
+    stats.output_content_size += _payload.size();
+}
+
+void adaptive_encoder::encode(std::istream &input_stream, std::ostream &output_stream) {
+    write_header(output_stream);
+    output_stream.flush();
+
+    std::vector<char> buffer(FRAME_SIZE);
+    // peek() waits for at least a byte, readsome() then takes only what is already buffered.
+    while (input_stream.peek() != std::char_traits<char>::eof()) {
+        auto size = static_cast<size_t>(input_stream.readsome(buffer.data(), buffer.size()));
+        if (size == 0 && input_stream.read(buffer.data(), 1))
+            size = 1;
+        write_frame(reinterpret_cast<const uint8_t *>(buffer.data()), size, output_stream);
+        if (input_stream.rdbuf()->in_avail() <= 0)
+            output_stream.flush();
+    }
+
+    bit_writer(output_stream, stats).write_varint(0);
+}
+
+void adaptive_encoder::encode(const uint8_t *data, size_t size, std::ostream &output_stream) {
+    write_header(output_stream);
+    for (const auto *end = data + size; data != end;) {
+        const auto frame_size = std::min<size_t>(end - data, FRAME_SIZE);
+        write_frame(data, frame_size, output_stream);
+        data += frame_size;
+    }
+    bit_writer(output_stream, stats).write_varint(0);
+}
+
+adaptive_decoder::adaptive_decoder(adaptive_options options): _model(options) {
+}
+
+void adaptive_decoder::check_options(const adaptive_options &options) {
+    if (options.rebuild_interval == 0 || !is_valid_code_length_limit(options.max_code_length))
+        throw huffman_format_error("invalid adaptive options");
+}
+
+uint64_t adaptive_decoder::max_payload_size(uint64_t count, const adaptive_options &options) noexcept {
+    return (count * options.max_code_length + 7) / 8;
+}
+
+void adaptive_decoder::decode_frame(const uint8_t *payload, size_t payload_size, uint8_t *output, size_t count,
+                                    statistic &stats) {
+    word_bit_reader bits(payload, payload_size, stats);
+    for (const auto *end = output + count; output != end;) {
+        const auto segment = static_cast<size_t>(std::min<uint64_t>(end - output, _model.until_rebuild()));
+        _model.table().decode(bits, output, segment);
+        _model.update(output, segment);
+        output += segment;
+    }
+    stats.output_content_size += count;
+}
+
+namespace {
+    adaptive_options read_options(bit_reader &reader) {
+        adaptive_options options;
+        options.rebuild_interval = reader.read_varint();
+        const auto max_code_length = reader.read_varint();
+        options.max_code_length = static_cast<uint8_t>(std::min<uint64_t>(max_code_length, UINT8_MAX));
+        adaptive_decoder::check_options(options);
+        return options;
+    }
+}
+
+void decode_adaptive(std::istream &input_stream, std::ostream &output_stream, statistic &stats) {
+    adaptive_stream_decoder decoder(input_stream, stats);
+    while (const auto count = decoder.decode_next()) {
+        output_stream.write(reinterpret_cast<const char *>(decoder.output()), count);
+        // Nothing more is buffered, so the next read may wait on a pipe: hand out what is decoded first.
+        if (input_stream.rdbuf()->in_avail() <= 0)
+            output_stream.flush();
+    }
+}
+
+adaptive_stream_decoder::adaptive_stream_decoder(std::istream &input_stream, statistic &stats)
+    : _input_stream(input_stream),
+      _stats(stats),
+      _reader(input_stream, stats),
+      _options(read_options(_reader)),
+      _decoder(_options) {
+}
+
+size_t adaptive_stream_decoder::decode_next() {
+    const auto count = _reader.read_varint();
+    if (count == 0)
+        return 0;
+    const auto payload_size = _reader.read_varint();
+    if (count > adaptive_encoder::FRAME_SIZE || payload_size > adaptive_decoder::max_payload_size(count, _options))
+        throw huffman_format_error("invalid adaptive frame");
+
+    _payload.resize(payload_size);
+    if (!_input_stream.read(reinterpret_cast<char *>(_payload.data()), payload_size))
+        throw huffman_format_error("truncated frame");
+
+    _output.resize(count);
+    _decoder.decode_frame(_payload.data(), _payload.size(), _output.data(), _output.size(), _stats);
+    return _output.size();
+}
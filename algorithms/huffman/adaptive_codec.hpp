@@ -0,0 +1,116 @@
+#pragma once
+
+#include "huffman.hpp"
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+// Adaptive container: both sides start with equal counts for every byte and rebuild the canonical
+// codes from the counts of everything coded so far, first after MIN_REBUILD_INTERVAL symbols and
+// then at doubling intervals up to `rebuild_interval`. No histogram is needed up front, so input is
+// coded as it arrives. The header holds the options, then come frames of (symbols count, payload
+// size, payload) and a zero count terminates the stream.
+struct adaptive_options {
+    static constexpr uint64_t DEFAULT_REBUILD_INTERVAL = 32u << 10u;
+    static constexpr uint64_t MIN_REBUILD_INTERVAL = 256;
+    // Bytes not seen yet still hold codes, the limit keeps them and the rebuilt decode tables short.
+    static constexpr uint8_t DEFAULT_MAX_CODE_LENGTH = 15;
+
+    uint64_t rebuild_interval = DEFAULT_REBUILD_INTERVAL;
+    uint8_t max_code_length = DEFAULT_MAX_CODE_LENGTH;
+};
+
+class adaptive_model final {
+public:
+    // Counts are halved once their sum passes this, so the codes follow a drifting distribution.
+    static constexpr uint64_t AGING_LIMIT = 1u << 20u;
+
+    explicit adaptive_model(adaptive_options options);
+
+    // Symbols that may be coded before the codes change.
+    [[nodiscard]] uint64_t until_rebuild() const noexcept { return _until_rebuild; }
+
+    // Counts symbols that were just coded, at most until_rebuild() of them.
+    void update(const uint8_t *data, size_t size);
+
+    [[nodiscard]] const huffman_tree::code_table &codes() const noexcept { return _codes; }
+
+    // Built on first use after every rebuild, encoders never need it.
+    [[nodiscard]] const decode_table &table();
+
+private:
+    void rebuild();
+
+    adaptive_options _options;
+    huffman_tree::char_counter _counts;
+    uint64_t _total = 0;
+    uint64_t _interval = 0;
+    uint64_t _until_rebuild = 0;
+    huffman_tree::code_table _codes;
+    decode_table _table;
+    bool _is_table_stale = true;
+};
+
+class adaptive_encoder final {
+public:
+    static constexpr size_t FRAME_SIZE = 1u << 16u;
+
+    // Throws std::invalid_argument for a zero interval or a limit outside [8, 64].
+    explicit adaptive_encoder(adaptive_options options = {});
+
+    // Frames whatever the stream has buffered and flushes when it has nothing more, so data from
+    // a pipe leaves without waiting for the following input.
+    void encode(std::istream &input_stream, std::ostream &output_stream);
+    void encode(const uint8_t *data, size_t size, std::ostream &output_stream);
+
+    statistic stats;
+    adaptive_options options;
+
+private:
+    void write_header(std::ostream &output_stream);
+    void write_frame(const uint8_t *data, size_t size, std::ostream &output_stream);
+
+    adaptive_model _model;
+    std::vector<uint8_t> _payload;
+};
+
+class adaptive_decoder final {
+public:
+    explicit adaptive_decoder(adaptive_options options);
+
+    // Throws huffman_format_error for options no encoder writes.
+    static void check_options(const adaptive_options &options);
+    [[nodiscard]] static uint64_t max_payload_size(uint64_t count, const adaptive_options &options) noexcept;
+
+    // Frames have to come in the order they were written, the model carries over between them.
+    void decode_frame(const uint8_t *payload, size_t payload_size, uint8_t *output, size_t count, statistic &stats);
+
+private:
+    adaptive_model _model;
+};
+
+// Decodes the header options and frames that follow an already consumed version byte.
+void decode_adaptive(std::istream &input_stream, std::ostream &output_stream, statistic &stats);
+
+// Decodes the same stream a frame at a time, for callers that pull the content.
+class adaptive_stream_decoder final {
+public:
+    // Reads the options, throws huffman_format_error for options no encoder writes.
+    adaptive_stream_decoder(std::istream &input_stream, statistic &stats);
+
+    // Returns the size of the next frame, zero after the last one; output() holds it until the next call.
+    size_t decode_next();
+
+    [[nodiscard]] const uint8_t *output() const noexcept { return _output.data(); }
+
+private:
+    std::istream &_input_stream;
+    statistic &_stats;
+    bit_reader _reader;
+    adaptive_options _options;
+    adaptive_decoder _decoder;
+    std::vector<uint8_t> _payload;
+    std::vector<uint8_t> _output;
+};
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <cstdint>
+
+// Calls of the global operator new so far in the whole process. allocation_counter.cpp replaces
+// operator new with one that counts, so only executables link it, never the codec itself.
+[[nodiscard]] uint64_t allocation_count() noexcept;
@@ -0,0 +1,280 @@
+#include "ans_codec.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include <utility>
+
+namespace {
+    uint8_t floor_log2(uint32_t value) {
+        return static_cast<uint8_t>(31 - __builtin_clz(value));
+    }
+
+    uint8_t choose_table_log(size_t size) {
+        if (size >= size_t(1) << (ans_counts::MAX_TABLE_LOG + 2))
+            return ans_counts::MAX_TABLE_LOG;
+        const auto table_log = static_cast<uint8_t>(floor_log2(static_cast<uint32_t>(std::max<size_t>(size, 1))) - 1);
+        return std::max(table_log, ans_counts::MIN_TABLE_LOG);
+    }
+
+    // Positions of the states of a symbol, spread over the table so every symbol reaches all of it.
+    std::vector<uint8_t> spread_symbols(const ans_counts &counts) {
+        const uint32_t table_size = 1u << counts.table_log;
+        const uint32_t step = (table_size >> 1u) + (table_size >> 3u) + 3;
+        std::vector<uint8_t> spread(table_size);
+        uint32_t position = 0;
+        for (size_t symbol = 0; symbol < counts.counts.size(); ++symbol) {
+            for (uint32_t count = 0; count < counts.counts[symbol]; ++count) {
+                spread[position] = static_cast<uint8_t>(symbol);
+                position = (position + step) & (table_size - 1);
+            }
+        }
+        return spread;
+    }
+
+    struct symbol_transform {
+        uint32_t delta_bits;
+        int32_t delta_state;
+    };
+
+    // Emits bits towards the start of the output, so the bits emitted last are read first.
+    class reverse_bit_writer {
+    public:
+        reverse_bit_writer(std::vector<uint8_t> &output, size_t capacity)
+            : _output(output), _start(output.size()) {
+            _output.resize(_start + capacity);
+            _position = _output.size();
+        }
+
+        void write(uint32_t bits, uint8_t length) {
+            _buffer |= uint64_t(bits) << _count;
+            _count += length;
+            if (_count >= 32) {
+                _position -= sizeof(uint32_t);
+                for (size_t byte = 0; byte < sizeof(uint32_t); ++byte)
+                    _output[_position + byte] = static_cast<uint8_t>(_buffer >> (24 - 8 * byte));
+                _buffer >>= 32u;
+                _count -= 32;
+            }
+        }
+
+        // Moves the bits to where the writer started and returns the zero bits that pad their start.
+        uint8_t finish() {
+            const auto bytes = static_cast<size_t>((_count + 7) / 8);
+            for (size_t byte = 0; byte < bytes; ++byte)
+                _output[--_position] = static_cast<uint8_t>(_buffer >> (8 * byte));
+            const auto size = _output.size() - _position;
+            std::copy(_output.begin() + _position, _output.end(), _output.begin() + _start);
+            _output.resize(_start + size);
+            return static_cast<uint8_t>(bytes * 8 - _count);
+        }
+
+    private:
+        std::vector<uint8_t> &_output;
+        size_t _start;
+        size_t _position;
+        uint64_t _buffer = 0;
+        uint8_t _count = 0;
+    };
+}
+
+// Counts start from their share of the table, at least 1, and then move a state at a time to the
+// symbol that saves the most bits with it or from the one that loses the least without it.
+ans_counts normalize_ans_counts(const huffman_tree::char_counter &counter, size_t size) {
+    ans_counts result;
+    result.table_log = choose_table_log(size);
+    const uint32_t table_size = 1u << result.table_log;
+
+    int64_t remaining = table_size;
+    for (size_t symbol = 0; symbol < counter.size(); ++symbol) {
+        if (counter[symbol] == 0)
+            continue;
+        const auto scaled = uint64_t(counter[symbol]) * table_size / std::max<size_t>(size, 1);
+        result.counts[symbol] = static_cast<uint16_t>(std::max<uint64_t>(scaled, 1));
+        remaining -= result.counts[symbol];
+    }
+
+    const auto cost = [&](size_t symbol, uint32_t from, uint32_t to) {
+        return double(counter[symbol]) * std::log2(double(from) / double(to));
+    };
+    const bool is_growing = remaining > 0;
+    const auto is_movable = [&](size_t symbol) {
+        return result.counts[symbol] != 0 && (is_growing || result.counts[symbol] != 1);
+    };
+    const auto gain = [&](size_t symbol) -> std::pair<double, size_t> {
+        const uint32_t count = result.counts[symbol];
+        return {is_growing ? cost(symbol, count + 1, count) : -cost(symbol, count, count - 1), symbol};
+    };
+
+    // A move changes the gain of its symbol only, so the gains stay in a heap instead of being scanned
+    // for every state. Ties go to the lower symbol.
+    const auto is_worse = [](const std::pair<double, size_t> &lhs, const std::pair<double, size_t> &rhs) {
+        return lhs.first < rhs.first || (lhs.first == rhs.first && lhs.second > rhs.second);
+    };
+    std::priority_queue<std::pair<double, size_t>, std::vector<std::pair<double, size_t>>, decltype(is_worse)>
+            gains(is_worse);
+    for (size_t symbol = 0; symbol < counter.size(); ++symbol) {
+        if (remaining != 0 && is_movable(symbol))
+            gains.push(gain(symbol));
+    }
+    for (; remaining != 0; remaining += is_growing ? -1 : 1) {
+        const auto best = gains.top().second;
+        gains.pop();
+        result.counts[best] = static_cast<uint16_t>(result.counts[best] + (is_growing ? 1 : -1));
+        if (is_movable(best))
+            gains.push(gain(best));
+    }
+    return result;
+}
+
+uint64_t ans_coded_bits(const huffman_tree::char_counter &counter, const ans_counts &counts) {
+    double bits = 0;
+    for (size_t symbol = 0; symbol < counter.size(); ++symbol) {
+        if (counter[symbol] != 0)
+            bits += double(counter[symbol]) * (counts.table_log - std::log2(double(counts.counts[symbol])));
+    }
+
+    std::vector<uint8_t> header;
+    append_ans_counts(header, counts);
+    return static_cast<uint64_t>(std::ceil(bits)) + (header.size() + 1) * 8 + 2 * counts.table_log;
+}
+
+// The table log, the number of symbols with counts, then every symbol with its count less one.
+void append_ans_counts(std::vector<uint8_t> &output, const ans_counts &counts) {
+    output.push_back(counts.table_log);
+    const auto symbols = std::count_if(counts.counts.begin(), counts.counts.end(), [](uint16_t count) {
+        return count != 0;
+    });
+    append_varint(output, symbols);
+    for (size_t symbol = 0; symbol < counts.counts.size(); ++symbol) {
+        if (counts.counts[symbol] != 0) {
+            output.push_back(static_cast<uint8_t>(symbol));
+            append_varint(output, counts.counts[symbol] - 1);
+        }
+    }
+}
+
+ans_counts read_ans_counts(const uint8_t *&data, const uint8_t *end) {
+    if (data == end)
+        throw huffman_format_error("truncated ans counts");
+    ans_counts result;
+    result.table_log = *data++;
+    if (result.table_log < ans_counts::MIN_TABLE_LOG || result.table_log > ans_counts::MAX_TABLE_LOG)
+        throw huffman_format_error("invalid ans counts");
+
+    const auto symbols = read_varint(data, end);
+    if (symbols == 0 || symbols > huffman_tree::CHARACTERS_COUNT)
+        throw huffman_format_error("invalid ans counts");
+    uint64_t total = 0;
+    uint8_t previous = 0;
+    for (uint64_t index = 0; index < symbols; ++index) {
+        if (data == end)
+            throw huffman_format_error("truncated ans counts");
+        const auto symbol = *data++;
+        const auto count = read_varint(data, end) + 1;
+        if ((index != 0 && symbol <= previous) || count > (1u << result.table_log))
+            throw huffman_format_error("invalid ans counts");
+        result.counts[symbol] = static_cast<uint16_t>(count);
+        total += count;
+        previous = symbol;
+    }
+    if (total != 1u << result.table_log)
+        throw huffman_format_error("invalid ans counts");
+    return result;
+}
+
+void append_ans(std::vector<uint8_t> &output, const uint8_t *data, size_t size, const ans_counts &counts) {
+    const auto table_log = counts.table_log;
+    const uint32_t table_size = 1u << table_log;
+    const auto spread = spread_symbols(counts);
+
+    // The states of every symbol in the order of their positions in the spread table.
+    std::array<uint32_t, huffman_tree::CHARACTERS_COUNT> cumulative{};
+    for (size_t symbol = 1; symbol < cumulative.size(); ++symbol)
+        cumulative[symbol] = cumulative[symbol - 1] + counts.counts[symbol - 1];
+    std::vector<uint16_t> states(table_size);
+    auto next = cumulative;
+    for (uint32_t position = 0; position < table_size; ++position)
+        states[next[spread[position]]++] = static_cast<uint16_t>(table_size + position);
+
+    // A state of [table_size, 2 * table_size) emits its low bits until it falls into [count, 2 * count)
+    // of its symbol, `delta_bits` yields their number with one shift.
+    std::array<symbol_transform, huffman_tree::CHARACTERS_COUNT> transforms{};
+    for (size_t symbol = 0; symbol < transforms.size(); ++symbol) {
+        const uint32_t count = counts.counts[symbol];
+        if (count == 0)
+            continue;
+        const auto max_bits = static_cast<uint32_t>(table_log - (count == 1 ? 0 : floor_log2(count - 1)));
+        transforms[symbol] = {(max_bits << 16u) - (count << max_bits),
+                              static_cast<int32_t>(cumulative[symbol]) - static_cast<int32_t>(count)};
+    }
+
+    const auto padding_position = output.size();
+    output.push_back(0);
+    reverse_bit_writer writer(output, (uint64_t(size) * table_log + 2 * table_log) / 8 + 2 * sizeof(uint64_t));
+    std::array<uint32_t, 2> state = {table_size, table_size};
+    for (auto index = size; index-- > 0;) {
+        auto &current = state[index & 1u];
+        const auto &transform = transforms[data[index]];
+        const auto bits = static_cast<uint8_t>((current + transform.delta_bits) >> 16u);
+        writer.write(current & ((1u << bits) - 1), bits);
+        current = states[(current >> bits) + transform.delta_state];
+    }
+    writer.write(state[1] - table_size, table_log);
+    writer.write(state[0] - table_size, table_log);
+    output[padding_position] = writer.finish();
+}
+
+ans_decoder::ans_decoder(const ans_counts &counts): _table(size_t(1) << counts.table_log), _table_log(counts.table_log) {
+    const auto spread = spread_symbols(counts);
+    std::array<uint32_t, huffman_tree::CHARACTERS_COUNT> next{};
+    std::copy(counts.counts.begin(), counts.counts.end(), next.begin());
+    for (size_t position = 0; position < _table.size(); ++position) {
+        const auto symbol = spread[position];
+        const auto state = next[symbol]++;
+        const auto bits = static_cast<uint8_t>(_table_log - floor_log2(state));
+        _table[position] = {static_cast<uint16_t>((state << bits) - _table.size()), symbol, bits};
+    }
+}
+
+word_bit_reader ans_decoder::start(const uint8_t *data, size_t size, statistic &stats) {
+    if (size == 0)
+        throw huffman_format_error("truncated ans stream");
+    const auto padding = *data;
+    if (padding > 7)
+        throw huffman_format_error("invalid ans stream");
+
+    word_bit_reader bits(data + 1, size - 1, stats);
+    bits.refill();
+    if (bits.available() < padding + 2 * _table_log)
+        throw huffman_format_error("truncated ans stream");
+    bits.consume(padding);
+    _even_state = bits.peek(_table_log);
+    bits.consume(_table_log);
+    _odd_state = bits.peek(_table_log);
+    bits.consume(_table_log);
+    return bits;
+}
+
+void ans_decoder::decode(word_bit_reader &bits, uint8_t *output, size_t count) {
+    const auto step = [&](uint32_t &state, uint8_t *symbol) {
+        const auto &entry = _table[state];
+        *symbol = entry.symbol;
+        state = entry.next_state + bits.peek_bits(entry.bits);
+        bits.consume(entry.bits);
+    };
+
+    // A refill keeps at least 57 bits, enough for four transitions of MAX_TABLE_LOG bits.
+    static_assert(4 * ans_counts::MAX_TABLE_LOG <= 57);
+    const auto *end = output + count;
+    for (; end - output >= 4; output += 4) {
+        bits.refill();
+        step(_even_state, output);
+        step(_odd_state, output + 1);
+        step(_even_state, output + 2);
+        step(_odd_state, output + 3);
+    }
+    bits.refill();
+    for (size_t index = 0; output != end; ++output, ++index)
+        step(index % 2 == 0 ? _even_state : _odd_state, output);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "huffman.hpp"
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+// Table-based asymmetric numeral systems (tANS, as in FSE): symbols get fractional code lengths from
+// counts normalized to the 1 << table_log states of the table, so skewed blocks come close to their
+// entropy where Huffman spends at least a bit per symbol. Two states take turns, even symbols go to the
+// first. The encoder runs backwards and the bitstream is written from its end, so the decoder reads
+// it forwards: a byte with the number of zero bits padding its start, then the two final states and
+// the bits of every transition.
+struct ans_counts {
+    static constexpr uint8_t MIN_TABLE_LOG = 8;
+    static constexpr uint8_t MAX_TABLE_LOG = 12;
+
+    uint8_t table_log = MAX_TABLE_LOG;
+    // Sum up to 1 << table_log, every symbol that occurs has a count.
+    std::array<uint16_t, huffman_tree::CHARACTERS_COUNT> counts{};
+};
+
+// Counts of `size` symbols scaled to the table with the least coded size, smaller blocks get smaller tables.
+ans_counts normalize_ans_counts(const huffman_tree::char_counter &counter, size_t size);
+// Size of the counts and the bitstream, within a few bits.
+[[nodiscard]] uint64_t ans_coded_bits(const huffman_tree::char_counter &counter, const ans_counts &counts);
+
+void append_ans_counts(std::vector<uint8_t> &output, const ans_counts &counts);
+// Throws huffman_format_error for counts no encoder writes.
+ans_counts read_ans_counts(const uint8_t *&data, const uint8_t *end);
+
+// Appends the bitstream of `size` symbols, all of which need a count.
+void append_ans(std::vector<uint8_t> &output, const uint8_t *data, size_t size, const ans_counts &counts);
+
+class ans_decoder final {
+public:
+    explicit ans_decoder(const ans_counts &counts);
+
+    // Skips the padding and reads the states, `data` starts with the padding byte.
+    word_bit_reader start(const uint8_t *data, size_t size, statistic &stats);
+
+    // Every call but the last has to decode an even count, so the states keep taking turns. Any input
+    // leads to valid states, corrupted streams decode to wrong symbols that the block checksum catches.
+    void decode(word_bit_reader &bits, uint8_t *output, size_t count);
+
+private:
+    struct entry {
+        uint16_t next_state;
+        uint8_t symbol;
+        uint8_t bits;
+    };
+
+    std::vector<entry> _table;
+    uint8_t _table_log;
+    uint32_t _even_state = 0;
+    uint32_t _odd_state = 0;
+};
@@ -0,0 +1,266 @@
+#include "archive.hpp"
+#include "crc32c.hpp"
+#include "mapped_file.hpp"
+
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+
+namespace {
+    constexpr size_t HEADER_SIZE = ARCHIVE_MAGIC.size() + 1;
+    constexpr size_t FOOTER_SIZE = sizeof(uint32_t) + sizeof(uint64_t);
+
+    size_t pool_size(size_t threads) {
+        return std::max<size_t>(threads, 1);
+    }
+
+    // Names extract below the destination: relative, without empty, "." or ".." parts.
+    bool is_safe_name(const std::string &name) {
+        if (name.empty() || name.find('\0') != std::string::npos)
+            return false;
+        for (size_t start = 0;;) {
+            const auto end = name.find('/', start);
+            const auto part = name.substr(start, end == std::string::npos ? end : end - start);
+            if (part.empty() || part == "." || part == "..")
+                return false;
+            if (end == std::string::npos)
+                return true;
+            start = end + 1;
+        }
+    }
+
+    std::string member_name(const std::filesystem::path &path) {
+        return path.lexically_normal().relative_path().generic_string();
+    }
+
+    template<typename T>
+    T read_little_endian(const uint8_t *data) {
+        T value = 0;
+        for (size_t byte = 0; byte < sizeof(T); ++byte)
+            value |= T(data[byte]) << (8 * byte);
+        return value;
+    }
+
+    template<typename T>
+    void append_little_endian(std::vector<uint8_t> &output, T value) {
+        for (size_t byte = 0; byte < sizeof(T); ++byte)
+            output.push_back(static_cast<uint8_t>(value >> (8 * byte)));
+    }
+}
+
+archive_writer::archive_writer(block_options options): options(options) {
+    if (options.block_size == 0)
+        throw std::invalid_argument("block size must be positive");
+    validate_code_length_limit(options.max_code_length);
+}
+
+void archive_writer::add(const std::string &path) {
+    const auto status = std::filesystem::status(path);
+    if (!std::filesystem::exists(status))
+        throw std::system_error(std::make_error_code(std::errc::no_such_file_or_directory), path);
+    if (std::filesystem::is_regular_file(status)) {
+        add_file(member_name(path), path);
+        return;
+    }
+    if (!std::filesystem::is_directory(status))
+        throw std::invalid_argument(path + " is neither a regular file nor a directory");
+
+    // Sorted, so the same tree always makes the same archive.
+    std::vector<std::filesystem::path> files;
+    for (const auto &entry: std::filesystem::recursive_directory_iterator(path)) {
+        if (entry.is_regular_file())
+            files.push_back(entry.path());
+    }
+    std::sort(files.begin(), files.end());
+    for (const auto &file: files)
+        add_file(member_name(std::filesystem::path(path) / file.lexically_relative(path)), file.string());
+}
+
+void archive_writer::add_file(std::string name, std::string path) {
+    if (!is_safe_name(name))
+        throw std::invalid_argument("archive members can not leave the current directory: " + path);
+    if (!_names.emplace(name, _files.size()).second)
+        throw std::invalid_argument("duplicate archive member " + name);
+    _files.emplace_back(std::move(name), std::move(path));
+}
+
+void archive_writer::write(std::ostream &output_stream) {
+    output_stream.write(ARCHIVE_MAGIC.data(), ARCHIVE_MAGIC.size());
+    output_stream.put(static_cast<char>(ARCHIVE_VERSION));
+    stats.additional_content_size += HEADER_SIZE;
+
+    struct pending_frame {
+        size_t member;
+        size_t size;
+        utils::task<encoded_block> task;
+    };
+
+    const auto threads = pool_size(options.threads);
+    std::deque<pending_frame> window;
+    std::vector<uint64_t> sizes(_files.size());
+    std::vector<uint64_t> compressed_sizes(_files.size());
+    uint64_t directory_offset = HEADER_SIZE;
+    std::vector<uint8_t> frame_header;
+    utils::thread_pool pool(threads);
+
+    const auto write_front = [&] {
+        const auto block = window.front().task.get();
+        frame_header.clear();
+        append_varint(frame_header, window.front().size);
+        append_varint(frame_header, block.payload.size());
+        output_stream.write(reinterpret_cast<const char *>(frame_header.data()), frame_header.size());
+        output_stream.write(reinterpret_cast<const char *>(block.payload.data()), block.payload.size());
+
+        const auto frame_size = frame_header.size() + block.payload.size();
+        compressed_sizes[window.front().member] += frame_size;
+        directory_offset += frame_size;
+        stats += block.stats;
+        stats.additional_content_size += frame_header.size();
+        window.pop_front();
+    };
+
+    for (size_t member = 0; member < _files.size(); ++member) {
+        // Shared with the tasks of its blocks, the mapping goes away with the last of them.
+        const auto file = std::make_shared<const mapped_file>(_files[member].second);
+        sizes[member] = file->size();
+        for (uint64_t start = 0; start < file->size(); start += options.block_size) {
+            const auto size = static_cast<size_t>(std::min<uint64_t>(options.block_size, file->size() - start));
+            window.push_back({member, size, pool.submit([file, start, size, options = options] {
+                return encode_block(file->data() + start, size, options.max_code_length);
+            })});
+            while (!window.empty() && (window.size() >= threads * block_options::BLOCKS_PER_THREAD ||
+                                       window.front().task.is_done()))
+                write_front();
+        }
+    }
+    while (!window.empty())
+        write_front();
+
+    std::vector<uint8_t> directory;
+    append_varint(directory, _files.size());
+    for (size_t member = 0; member < _files.size(); ++member) {
+        const auto &name = _files[member].first;
+        append_varint(directory, name.size());
+        directory.insert(directory.end(), name.begin(), name.end());
+        append_varint(directory, sizes[member]);
+        append_varint(directory, compressed_sizes[member]);
+    }
+    append_little_endian(directory, crc32c(0, directory.data(), directory.size()));
+    append_little_endian(directory, directory_offset);
+    output_stream.write(reinterpret_cast<const char *>(directory.data()), directory.size());
+    stats.additional_content_size += directory.size();
+}
+
+archive_reader::archive_reader(const uint8_t *data, size_t size): _data(data) {
+    if (size < HEADER_SIZE + FOOTER_SIZE)
+        throw huffman_format_error("truncated archive");
+    if (!std::equal(ARCHIVE_MAGIC.begin(), ARCHIVE_MAGIC.end(), reinterpret_cast<const char *>(data)))
+        throw huffman_format_error("not an archive");
+    if (data[ARCHIVE_MAGIC.size()] != ARCHIVE_VERSION)
+        throw huffman_format_error("unsupported archive version");
+
+    const auto *footer = data + size - FOOTER_SIZE;
+    const auto directory_offset = read_little_endian<uint64_t>(footer + sizeof(uint32_t));
+    if (directory_offset < HEADER_SIZE || directory_offset > size - FOOTER_SIZE)
+        throw huffman_format_error("invalid archive directory");
+    const auto *position = data + directory_offset;
+    if (crc32c(0, position, footer - position) != read_little_endian<uint32_t>(footer))
+        throw huffman_format_error("archive directory checksum mismatch");
+
+    // Every member takes at least three bytes of the directory.
+    const auto count = read_varint(position, footer);
+    if (count > uint64_t(footer - position) / 3)
+        throw huffman_format_error("invalid archive directory");
+    _members.reserve(count);
+    _index.reserve(count);
+
+    uint64_t offset = HEADER_SIZE;
+    for (uint64_t index = 0; index < count; ++index) {
+        archive_member member;
+        const auto name_size = read_varint(position, footer);
+        if (name_size > uint64_t(footer - position))
+            throw huffman_format_error("truncated archive directory");
+        member.name.assign(reinterpret_cast<const char *>(position), name_size);
+        position += name_size;
+        member.size = read_varint(position, footer);
+        member.compressed_size = read_varint(position, footer);
+        member.offset = offset;
+
+        if (!is_safe_name(member.name))
+            throw huffman_format_error("unsafe archive member name " + member.name);
+        if (member.compressed_size > directory_offset - offset)
+            throw huffman_format_error("invalid archive directory");
+        if (!_index.emplace(member.name, _members.size()).second)
+            throw huffman_format_error("duplicate archive member " + member.name);
+        offset += member.compressed_size;
+        _members.push_back(std::move(member));
+    }
+    if (position != footer || offset != directory_offset)
+        throw huffman_format_error("invalid archive directory");
+}
+
+const archive_member *archive_reader::find(const std::string &name) const {
+    const auto member = _index.find(name);
+    return member != _index.end() ? &_members[member->second] : nullptr;
+}
+
+statistic archive_reader::extract(const archive_member &member, std::ostream &output_stream) const {
+    statistic stats;
+    const auto *data = _data + member.offset;
+    const auto *end = data + member.compressed_size;
+    std::vector<uint8_t> block;
+    for (uint64_t position = 0; position < member.size;) {
+        const auto size = read_varint(data, end);
+        const auto payload_size = read_varint(data, end);
+        if (size == 0 || size > member.size - position || payload_size > uint64_t(end - data))
+            throw huffman_format_error("invalid archive frame");
+        block.resize(static_cast<size_t>(size));
+        stats += decode_block(data, payload_size, block.data(), block.size());
+        if (!output_stream.write(reinterpret_cast<const char *>(block.data()), block.size()))
+            throw std::system_error(errno, std::generic_category(), member.name);
+        data += payload_size;
+        position += size;
+    }
+    if (data != end)
+        throw huffman_format_error("invalid archive frame");
+    stats.input_file_size = member.compressed_size;
+    return stats;
+}
+
+statistic extract_members(const archive_reader &archive, const std::vector<const archive_member *> &members,
+                          const std::string &destination, size_t threads) {
+    // Directories first, so tasks writing files of the same one do not race to create it.
+    std::vector<std::string> paths;
+    for (const auto *member: members) {
+        const auto path = std::filesystem::path(destination) / member->name;
+        std::filesystem::create_directories(path.parent_path());
+        paths.push_back(path.string());
+    }
+
+    statistic stats;
+    std::deque<utils::task<statistic>> window;
+    utils::thread_pool pool(pool_size(threads));
+    for (size_t index = 0; index < members.size(); ++index) {
+        window.push_back(pool.submit([&archive, member = members[index], path = paths[index]] {
+            std::ofstream output_stream(path, std::ios::binary);
+            if (!output_stream)
+                throw std::system_error(errno, std::generic_category(), path);
+            return archive.extract(*member, output_stream);
+        }));
+        while (!window.empty() && (window.size() >= pool_size(threads) * block_options::BLOCKS_PER_THREAD ||
+                                   window.front().is_done())) {
+            stats += window.front().get();
+            window.pop_front();
+        }
+    }
+    for (; !window.empty(); window.pop_front())
+        stats += window.front().get();
+    return stats;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "block_codec.hpp"
+#include "huffman.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Archive layout: ARCHIVE_MAGIC and a version byte, the members one after another, the central
+// directory and a footer of the directory CRC32C and its offset, both little-endian. A member is a
+// sequence of checked block frames (raw size, payload size, payload) as in the block container,
+// without a terminator, since its size is in the directory. The directory holds the members count
+// and for every member its name, size and compressed size; members follow in the same order, so the
+// sizes give the offsets and any member decodes without reading the others.
+constexpr std::array<char, 4> ARCHIVE_MAGIC = {'\x89', 'H', 'U', 'A'};
+constexpr uint8_t ARCHIVE_VERSION = 1;
+
+struct archive_member {
+    // Relative path with '/' separators.
+    std::string name;
+    uint64_t size = 0;
+    // Of its frames, which start `offset` bytes into the archive.
+    uint64_t compressed_size = 0;
+    uint64_t offset = 0;
+};
+
+class archive_writer final {
+public:
+    // Throws std::invalid_argument for a zero block size or a code length limit outside [8, 64].
+    explicit archive_writer(block_options options = {});
+
+    // A regular file is named by its path, the files under a directory by their path joined to the one
+    // of the directory. Throws std::invalid_argument for names that are taken or leave the current
+    // directory and std::system_error for paths that do not exist.
+    void add(const std::string &path);
+
+    // Blocks of all members are coded on `threads` threads and written in order, a bounded window of
+    // them is in flight, so thousands of small files cost a task each instead of a process each.
+    void write(std::ostream &output_stream);
+
+    statistic stats;
+    block_options options;
+
+private:
+    void add_file(std::string name, std::string path);
+
+    // Names and paths of the members in the order they are written.
+    std::vector<std::pair<std::string, std::string>> _files;
+    std::unordered_map<std::string, size_t> _names;
+};
+
+// Reads the archive in place, `data` has to outlive it.
+class archive_reader final {
+public:
+    // Throws huffman_format_error for archives no writer makes, member names that are absolute or leave
+    // the destination among them.
+    archive_reader(const uint8_t *data, size_t size);
+
+    [[nodiscard]] const std::vector<archive_member> &members() const noexcept { return _members; }
+
+    // nullptr when no member has the name.
+    [[nodiscard]] const archive_member *find(const std::string &name) const;
+
+    // Decodes the member block by block to `output_stream`, so it holds one block at a time. Throws
+    // huffman_format_error when a block does not match its checksum and std::system_error when the
+    // stream fails. Safe to call from several threads at once.
+    statistic extract(const archive_member &member, std::ostream &output_stream) const;
+
+private:
+    const uint8_t *_data;
+    std::vector<archive_member> _members;
+    std::unordered_map<std::string, size_t> _index;
+};
+
+// Writes the members below `destination`, creating the directories they need, and decodes them on
+// `threads` threads. Throws std::system_error for files that can not be written.
+statistic extract_members(const archive_reader &archive, const std::vector<const archive_member *> &members,
+                          const std::string &destination, size_t threads);
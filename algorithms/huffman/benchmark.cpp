@@ -0,0 +1,581 @@
+#include "huffman.hpp"
+#include "allocation_counter.hpp"
+#include "adaptive_codec.hpp"
+#include "block_codec.hpp"
+#include "buffer_codec.hpp"
+#include "histogram.hpp"
+#include "instrumentation.hpp"
+#include "lz77_codec.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+namespace {
+    struct corpus {
+        std::string name;
+        std::string content;
+        // Order-0 entropy in bits per byte, the bound for the ratio is entropy / 8.
+        double entropy = 0;
+    };
+
+    struct measurement {
+        std::string corpus;
+        std::string operation;
+        double entropy = 0;
+        size_t threads = 1;
+        size_t bytes = 0;
+        double megabytes_per_second = 0;
+        // Compressed size over the input size, zero for operations that do not compress.
+        double ratio = 0;
+        long peak_memory_kilobytes = 0;
+        uint64_t allocations = 0;
+        // Until the first LATENCY_BYTES of output exist, zero for operations that do not encode.
+        double latency_microseconds = 0;
+    };
+
+    constexpr size_t LATENCY_BYTES = 4u << 10u;
+
+    // Drops the output and notes when it grew past LATENCY_BYTES.
+    class latency_streambuf final : public std::streambuf {
+    public:
+        std::chrono::steady_clock::time_point reached;
+
+    protected:
+        int_type overflow(int_type character) override {
+            if (!traits_type::eq_int_type(character, traits_type::eof()))
+                count(1);
+            return traits_type::not_eof(character);
+        }
+
+        std::streamsize xsputn(const char_type *, std::streamsize size) override {
+            count(static_cast<size_t>(size));
+            return size;
+        }
+
+    private:
+        void count(size_t size) {
+            if (_size < LATENCY_BYTES && _size + size >= LATENCY_BYTES)
+                reached = std::chrono::steady_clock::now();
+            _size += size;
+        }
+
+        size_t _size = 0;
+    };
+
+    // Best of `repeats` runs of `encode`, which gets the output stream. A pipe reader on the other end
+    // waits this long for its first data.
+    template<typename F>
+    double latency_microseconds(uint32_t repeats, F &&encode) {
+        double best = 0;
+        for (uint32_t run = 0; run < repeats; ++run) {
+            latency_streambuf buffer;
+            std::ostream output(&buffer);
+            const auto start = std::chrono::steady_clock::now();
+            encode(output);
+            const std::chrono::duration<double, std::micro> elapsed = buffer.reached - start;
+            best = run == 0 ? elapsed.count() : std::min(best, elapsed.count());
+        }
+        return std::max(best, 0.0);
+    }
+
+    std::string generate_uniform(size_t size, std::mt19937 &random) {
+        std::uniform_int_distribution<int> distribution(0, 255);
+        std::string content(size, '\0');
+        for (auto &character : content)
+            character = static_cast<char>(distribution(random));
+        return content;
+    }
+
+    // Entropy of the geometric distribution in bits per symbol.
+    double geometric_entropy(double p) {
+        return (-(1 - p) * std::log2(1 - p) - p * std::log2(p)) / p;
+    }
+
+    // The entropy falls as p grows, so bisection finds the p of the requested entropy.
+    double geometric_parameter(double bits) {
+        double low = 1e-3;
+        double high = 1 - 1e-9;
+        for (int iteration = 0; iteration < 64; ++iteration) {
+            const auto middle = (low + high) / 2;
+            if (geometric_entropy(middle) > bits)
+                low = middle;
+            else
+                high = middle;
+        }
+        return (low + high) / 2;
+    }
+
+    std::string generate_skewed(size_t size, double bits, std::mt19937 &random) {
+        std::geometric_distribution<int> distribution(geometric_parameter(bits));
+        std::string content(size, '\0');
+        for (auto &character : content)
+            character = static_cast<char>(std::min(distribution(random), 255));
+        return content;
+    }
+
+    // Symbol frequencies follow the Fibonacci numbers like in fib_unbalanced.in, which gives the
+    // deepest trees for the alphabet size.
+    std::string generate_fibonacci(size_t size, std::mt19937 &random) {
+        std::vector<double> weights = {1, 1};
+        while (weights.size() < 32)
+            weights.push_back(weights[weights.size() - 1] + weights[weights.size() - 2]);
+        std::discrete_distribution<int> distribution(weights.begin(), weights.end());
+
+        std::string content(size, '\0');
+        for (auto &character : content)
+            character = static_cast<char>(distribution(random));
+        return content;
+    }
+
+    std::string generate_text(size_t size, std::mt19937 &random) {
+        static const std::vector<std::string> words = {
+            "the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as", "was", "with", "be", "by",
+            "on", "not", "he", "this", "are", "or", "his", "from", "at", "which", "but", "have", "an", "had",
+            "they", "you", "were", "their", "one", "all", "we", "can", "her", "has", "there", "been", "if",
+            "more", "when", "will", "would", "who", "so", "no", "ERROR", "WARN", "INFO", "request", "0x7f3a",
+        };
+        std::discrete_distribution<size_t> distribution = [] {
+            std::vector<double> weights;
+            for (size_t rank = 1; rank <= words.size(); ++rank)
+                weights.push_back(1.0 / double(rank));
+            return std::discrete_distribution<size_t>(weights.begin(), weights.end());
+        }();
+
+        std::string content;
+        content.reserve(size + 16);
+        while (content.size() < size) {
+            content += words[distribution(random)];
+            content += random() % 12 == 0 ? '\n' : ' ';
+        }
+        content.resize(size);
+        return content;
+    }
+
+    // Long runs of few distinct bytes, like sparse bitmaps or padded records.
+    std::string generate_runs(size_t size, std::mt19937 &random) {
+        std::uniform_int_distribution<int> character(0, 3);
+        std::uniform_int_distribution<size_t> length(16, 256);
+        std::string content;
+        content.reserve(size + 256);
+        while (content.size() < size)
+            content.append(length(random), static_cast<char>(character(random)));
+        content.resize(size);
+        return content;
+    }
+
+    double entropy(const std::string &content) {
+        byte_histogram histogram{};
+        accumulate_histogram(reinterpret_cast<const uint8_t *>(content.data()), content.size(), histogram);
+
+        return shannon_entropy(histogram);
+    }
+
+    long resident_kilobytes(const std::string &key) {
+        std::ifstream status("/proc/self/status");
+        for (std::string line; std::getline(status, line);) {
+            if (line.compare(0, key.size(), key) == 0)
+                return std::stol(line.substr(key.size()));
+        }
+
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+    }
+
+    // Lowers the peak to the current size of the process. Elsewhere than on Linux the peak of
+    // the whole process is reported.
+    void reset_peak_memory() {
+        std::ofstream("/proc/self/clear_refs") << "5";
+    }
+
+    double megabytes_per_second(size_t size, std::chrono::steady_clock::time_point start) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return double(size) / (1 << 20) / elapsed.count();
+    }
+
+    // Keeps the best throughput of `repeats` runs, memory and allocations come from the first one.
+    // `function` returns the compressed size.
+    template<typename F>
+    measurement measure(const corpus &corpus, const std::string &operation, uint32_t repeats, F &&function) {
+        measurement result;
+        result.corpus = corpus.name;
+        result.operation = operation;
+        result.entropy = corpus.entropy;
+        result.bytes = corpus.content.size();
+
+        for (uint32_t run = 0; run < repeats; ++run) {
+            reset_peak_memory();
+            const auto resident = resident_kilobytes("VmRSS:");
+            const auto allocations = allocation_count();
+            auto start = std::chrono::steady_clock::now();
+            const size_t compressed_size = function();
+            result.megabytes_per_second = std::max(result.megabytes_per_second,
+                                                   megabytes_per_second(corpus.content.size(), start));
+            if (run == 0) {
+                result.allocations = allocation_count() - allocations;
+                result.peak_memory_kilobytes = std::max(0l, resident_kilobytes("VmHWM:") - resident);
+                result.ratio = corpus.content.empty() ? 0 : double(compressed_size) / double(result.bytes);
+            }
+        }
+        return result;
+    }
+
+    void verify(const corpus &corpus, const std::string &output, const std::string &operation) {
+        if (output != corpus.content) {
+            std::cerr << corpus.name << ": " << operation << " round trip mismatch" << std::endl;
+            std::exit(1);
+        }
+    }
+
+    std::string compress(const corpus &corpus, format_version format) {
+        const auto *data = reinterpret_cast<const uint8_t *>(corpus.content.data());
+        std::ostringstream output;
+        huffman_encoder encoder(data, corpus.content.size(), format);
+        encoder.encode(data, corpus.content.size(), output);
+        return output.str();
+    }
+
+    measurement measure_encode(const corpus &corpus, uint32_t repeats) {
+        const auto *data = reinterpret_cast<const uint8_t *>(corpus.content.data());
+        const auto encode = [&](std::ostream &output) {
+            huffman_encoder encoder(data, corpus.content.size());
+            encoder.encode(data, corpus.content.size(), output);
+        };
+
+        auto result = measure(corpus, "encode", repeats, [&] {
+            std::ostringstream output;
+            encode(output);
+            return static_cast<size_t>(output.tellp());
+        });
+        result.latency_microseconds = latency_microseconds(repeats, encode);
+        return result;
+    }
+
+    // The adaptive coder against the static one: the ratio it gives up and the latency it saves.
+    std::vector<measurement> measure_adaptive(const corpus &corpus, uint32_t repeats) {
+        const auto *data = reinterpret_cast<const uint8_t *>(corpus.content.data());
+        const auto encode = [&](std::ostream &output) {
+            adaptive_encoder encoder;
+            encoder.encode(data, corpus.content.size(), output);
+        };
+
+        std::string compressed;
+        std::vector<measurement> results;
+        results.push_back(measure(corpus, "adaptive_encode", repeats, [&] {
+            std::ostringstream output;
+            encode(output);
+            compressed = output.str();
+            return compressed.size();
+        }));
+        results.back().latency_microseconds = latency_microseconds(repeats, encode);
+
+        results.push_back(measure(corpus, "adaptive_decode", repeats, [&] {
+            std::istringstream input(compressed);
+            std::ostringstream output;
+            huffman_decoder decoder(input);
+            decoder.decode(output);
+            verify(corpus, output.str(), "adaptive_decode");
+            return compressed.size();
+        }));
+        return results;
+    }
+
+    // Ratio and throughput of the match finder at a few levels, decoded through the buffer API.
+    std::vector<measurement> measure_lz77(const corpus &corpus, uint32_t repeats) {
+        const auto *data = reinterpret_cast<const uint8_t *>(corpus.content.data());
+        std::vector<measurement> results;
+        for (const uint8_t level : {1, 3, 6, 9}) {
+            const auto suffix = "_" + std::to_string(level);
+            lz77_options options;
+            options.level = level;
+            std::string compressed;
+            results.push_back(measure(corpus, "lz77_encode" + suffix, repeats, [&] {
+                std::ostringstream output;
+                lz77_encoder encoder(options);
+                encoder.encode(data, corpus.content.size(), output);
+                compressed = output.str();
+                return compressed.size();
+            }));
+
+            huffman_context context;
+            std::string output(corpus.content.size(), '\0');
+            results.push_back(measure(corpus, "lz77_decode" + suffix, repeats, [&] {
+                context.decompress(reinterpret_cast<const uint8_t *>(compressed.data()), compressed.size(),
+                                   reinterpret_cast<uint8_t *>(&output[0]), output.size());
+                verify(corpus, output, "lz77_decode" + suffix);
+                return compressed.size();
+            }));
+        }
+        return results;
+    }
+
+    measurement measure_decode(const corpus &corpus, const std::string &operation, format_version format,
+                               decoding_engine engine, uint32_t repeats) {
+        const auto compressed = compress(corpus, format);
+        return measure(corpus, operation, repeats, [&] {
+            std::istringstream input(compressed);
+            std::ostringstream output;
+            huffman_decoder decoder(input, engine);
+            decoder.decode(output);
+            verify(corpus, output.str(), operation);
+            return compressed.size();
+        });
+    }
+
+    // Decodes from memory straight into the output, a chunk per call, without a stream on either side.
+    measurement measure_decode_bulk(const corpus &corpus, uint32_t repeats) {
+        constexpr size_t CHUNK_SIZE = 1u << 16u;
+        const auto compressed = compress(corpus, format_version::canonical);
+        std::string output(corpus.content.size(), '\0');
+        return measure(corpus, "decode_bulk", repeats, [&] {
+            huffman_decoder decoder(reinterpret_cast<const uint8_t *>(compressed.data()), compressed.size());
+            auto *output_data = reinterpret_cast<uint8_t *>(&output[0]);
+            size_t size = 0;
+            while (const auto count = decoder.decode(output_data + size, std::min(CHUNK_SIZE, output.size() - size)))
+                size += count;
+            if (size != output.size())
+                verify(corpus, output.substr(0, size), "decode_bulk");
+            verify(corpus, output, "decode_bulk");
+            return compressed.size();
+        });
+    }
+
+    // Both directions run once up front, the measured calls reuse the warm context.
+    std::vector<measurement> measure_context(const corpus &corpus, uint32_t repeats) {
+        const auto *data = reinterpret_cast<const uint8_t *>(corpus.content.data());
+        huffman_context context;
+        std::vector<uint8_t> compressed(huffman_context::max_compressed_size(corpus.content.size()));
+        std::string output(corpus.content.size(), '\0');
+        auto *output_data = reinterpret_cast<uint8_t *>(&output[0]);
+
+        size_t compressed_size = context.compress(data, corpus.content.size(), compressed.data(), compressed.size());
+        std::vector<measurement> results;
+        results.push_back(measure(corpus, "context_encode", repeats, [&] {
+            return context.compress(data, corpus.content.size(), compressed.data(), compressed.size());
+        }));
+
+        context.decompress(compressed.data(), compressed_size, output_data, output.size());
+        results.push_back(measure(corpus, "context_decode", repeats, [&] {
+            std::fill(output.begin(), output.end(), '\0');
+            const auto size = context.decompress(compressed.data(), compressed_size, output_data, output.size());
+            if (size != output.size())
+                verify(corpus, output.substr(0, size), "context_decode");
+            verify(corpus, output, "context_decode");
+            return compressed_size;
+        }));
+        return results;
+    }
+
+    std::vector<measurement> measure_blocks(const corpus &corpus, size_t max_threads, uint32_t repeats) {
+        std::vector<size_t> thread_counts;
+        for (size_t threads = 1; threads < max_threads; threads *= 2)
+            thread_counts.push_back(threads);
+        thread_counts.push_back(max_threads);
+
+        std::vector<measurement> results;
+        for (const auto threads : thread_counts) {
+            block_options options;
+            options.threads = threads;
+            std::string compressed;
+
+            results.push_back(measure(corpus, "block_encode", repeats, [&] {
+                std::istringstream input(corpus.content);
+                std::ostringstream output;
+                block_encoder encoder(options);
+                encoder.encode(input, output);
+                compressed = output.str();
+                return compressed.size();
+            }));
+            results.back().threads = threads;
+
+            results.push_back(measure(corpus, "block_decode", repeats, [&] {
+                std::istringstream input(compressed);
+                std::ostringstream output;
+                huffman_decoder decoder(input, decoding_engine::table, threads);
+                decoder.decode(output);
+                verify(corpus, output.str(), "block_decode");
+                return compressed.size();
+            }));
+            results.back().threads = threads;
+        }
+        return results;
+    }
+
+    // The loop count_characters used before the kernels, kept as the baseline.
+    void accumulate_histogram_plain(const uint8_t *data, size_t size, byte_histogram &histogram) {
+        for (const auto *end = data + size; data != end; ++data)
+            ++histogram[*data];
+    }
+
+    template<typename F>
+    measurement measure_histogram(const corpus &corpus, const std::string &operation, F &&kernel, uint32_t repeats) {
+        const auto *data = reinterpret_cast<const uint8_t *>(corpus.content.data());
+        byte_histogram expected{};
+        accumulate_histogram_plain(data, corpus.content.size(), expected);
+
+        return measure(corpus, operation, repeats, [&] {
+            byte_histogram histogram{};
+            kernel(data, corpus.content.size(), histogram);
+            if (histogram != expected) {
+                std::cerr << corpus.name << ": " << operation << " mismatch" << std::endl;
+                std::exit(1);
+            }
+            return size_t(0);
+        });
+    }
+
+    std::string escape(const std::string &string) {
+        std::string result;
+        for (const auto character : string) {
+            if (character == '"' || character == '\\')
+                result += '\\';
+            result += character;
+        }
+        return result;
+    }
+
+    // One JSON object per line with stable keys, so runs can be compared line by line.
+    void print_json(const std::vector<measurement> &results, std::ostream &os) {
+        for (const auto &result : results) {
+            os << "{\"corpus\": \"" << escape(result.corpus) << "\", \"operation\": \"" << result.operation
+               << "\", \"entropy\": " << result.entropy << ", \"threads\": " << result.threads << ", \"bytes\": " << result.bytes
+               << ", \"mb_per_s\": " << result.megabytes_per_second << ", \"ratio\": " << result.ratio
+               << ", \"peak_memory_kb\": " << result.peak_memory_kilobytes
+               << ", \"allocations\": " << result.allocations
+               << ", \"latency_us\": " << result.latency_microseconds << "}" << std::endl;
+        }
+    }
+
+    void print_table(const std::vector<measurement> &results, std::ostream &os) {
+        os << std::left << std::setw(24) << "corpus" << std::setw(20) << "operation" << std::right
+           << std::setw(9) << "entropy" << std::setw(8) << "threads" << std::setw(12) << "MB/s" << std::setw(10) << "ratio"
+           << std::setw(12) << "peak KiB" << std::setw(14) << "allocations" << std::setw(14) << "latency us"
+           << std::endl;
+        for (const auto &result : results) {
+            os << std::left << std::setw(24) << result.corpus << std::setw(20) << result.operation << std::right
+               << std::fixed << std::setprecision(3) << std::setw(9) << result.entropy
+               << std::setw(8) << result.threads << std::setprecision(1)
+               << std::setw(12) << result.megabytes_per_second << std::setprecision(3)
+               << std::setw(10) << result.ratio << std::setw(12) << result.peak_memory_kilobytes
+               << std::setw(14) << result.allocations << std::setprecision(1)
+               << std::setw(14) << result.latency_microseconds << std::endl;
+        }
+    }
+
+    void print_usage(const std::string &name, std::ostream &os) {
+        os << "Usage:" << std::endl;
+        os << "\t" << name << " [-s megabytes] [-e bits] [-r repeats] [-j threads] [-f file] [-w directory] [-m]"
+           << std::endl;
+        os << "\t-e\tentropy of the skewed corpus in bits per byte" << std::endl;
+        os << "\t-w\twrite the generated corpora into the directory instead of measuring" << std::endl;
+        os << "\t-m\tprint one JSON object per measurement" << std::endl;
+    }
+}
+
+int main(int argc, char **argv) {
+    program_arguments arguments(argc, argv, print_usage);
+    char_cli_argument size_argument('s', 1);
+    char_cli_argument entropy_argument('e', 1);
+    char_cli_argument repeats_argument('r', 1);
+    char_cli_argument file_argument('f', 1);
+    char_cli_argument threads_argument('j', 1);
+    char_cli_argument write_argument('w', 1);
+    optional_cli_argument machine_argument('m');
+
+    size_t size = 16u << 20u;
+    double skewed_entropy = 3.6;
+    uint32_t repeats = 3;
+    size_t threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    try {
+        if (auto option = arguments.option_for(size_argument)) {
+            size = parse_number(option->arguments[0], "-s", SIZE_MAX >> 20u) << 20u;
+            if (size == 0)
+                throw std::invalid_argument("-s needs a positive size");
+        }
+        if (auto option = arguments.option_for(entropy_argument))
+            skewed_entropy = std::clamp(std::stod(option->arguments[0]), 0.01, 8.0);
+        if (auto option = arguments.option_for(repeats_argument))
+            repeats = std::max<uint32_t>(parse_number(option->arguments[0], "-r", UINT32_MAX), 1);
+        // Zero threads run the work on one, as in huffman.
+        if (auto option = arguments.option_for(threads_argument))
+            threads = std::max<size_t>(parse_number(option->arguments[0], "-j", block_options::MAX_THREADS), 1);
+    } catch (const std::invalid_argument &error) {
+        std::cerr << "Invalid argument: " << error.what() << std::endl;
+        arguments.print_usage(std::cerr);
+        return 1;
+    }
+
+    std::mt19937 random(42);
+    std::vector<corpus> corpora;
+    if (auto option = arguments.option_for(file_argument)) {
+        std::ifstream file(option->arguments[0], std::ios::binary);
+        if (!file) {
+            arguments.print_usage(std::cerr);
+            return 1;
+        }
+        corpora.push_back({option->arguments[0], std::string(std::istreambuf_iterator<char>(file), {})});
+    }
+    corpora.push_back({"text", generate_text(size, random)});
+    corpora.push_back({"skewed", generate_skewed(size, skewed_entropy, random)});
+    corpora.push_back({"fibonacci", generate_fibonacci(size, random)});
+    corpora.push_back({"uniform", generate_uniform(size, random)});
+    corpora.push_back({"runs", generate_runs(size, random)});
+    for (auto &corpus : corpora)
+        corpus.entropy = entropy(corpus.content);
+
+    if (auto option = arguments.option_for(write_argument)) {
+        for (const auto &corpus : corpora) {
+            std::ofstream file(option->arguments[0] + "/" + corpus.name + ".bin", std::ios::binary);
+            file.write(corpus.content.data(), corpus.content.size());
+            std::cerr << corpus.name << ": " << corpus.content.size() << " bytes, " << corpus.entropy
+                      << " bits per byte" << std::endl;
+        }
+        return 0;
+    }
+
+    std::vector<measurement> results;
+    for (const auto &corpus : corpora) {
+        results.push_back(measure_encode(corpus, repeats));
+        // The tree walk can only decode the legacy layout.
+        results.push_back(measure_decode(corpus, "decode_tree", format_version::legacy, decoding_engine::tree,
+                                         repeats));
+        results.push_back(measure_decode(corpus, "decode_table", format_version::canonical, decoding_engine::table,
+                                         repeats));
+        results.push_back(measure_decode(corpus, "decode_interleaved", format_version::interleaved,
+                                         decoding_engine::table, repeats));
+        results.push_back(measure_decode_bulk(corpus, repeats));
+        const auto adaptive = measure_adaptive(corpus, repeats);
+        results.insert(results.end(), adaptive.begin(), adaptive.end());
+        const auto context = measure_context(corpus, repeats);
+        results.insert(results.end(), context.begin(), context.end());
+        const auto lz77 = measure_lz77(corpus, repeats);
+        results.insert(results.end(), lz77.begin(), lz77.end());
+        // Blocks choose between Huffman and tANS codes, the thread counts only matter on one corpus.
+        const auto blocks = measure_blocks(corpus, corpus.name == "text" ? threads : 1, repeats);
+        results.insert(results.end(), blocks.begin(), blocks.end());
+        results.push_back(measure_histogram(corpus, "histogram_plain", accumulate_histogram_plain, repeats));
+        results.push_back(measure_histogram(corpus, "histogram_scalar", accumulate_histogram_scalar, repeats));
+        if (has_avx2())
+            results.push_back(measure_histogram(corpus, "histogram_avx2", accumulate_histogram_avx2, repeats));
+        results.push_back(measure_histogram(corpus, "histogram_dispatch", accumulate_histogram, repeats));
+    }
+
+    if (arguments.option_for(machine_argument))
+        print_json(results, std::cout);
+    else
+        print_table(results, std::cout);
+}
@@ -0,0 +1,388 @@
+#include "block_codec.hpp"
+#include "ans_codec.hpp"
+#include "bounded_queue.hpp"
+#include "crc32c.hpp"
+
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+    size_t pool_size(size_t threads) {
+        return std::max<size_t>(threads, 1);
+    }
+
+    constexpr size_t CHECKSUM_SIZE = sizeof(uint32_t);
+    constexpr uint64_t READ_CHUNK_SIZE = 1u << 20u;
+
+    uint64_t max_payload_size(uint64_t size) {
+        return 1 + huffman_tree::CHARACTERS_COUNT + size * sizeof(uint64_t) + CHECKSUM_SIZE;
+    }
+
+    // Reads the payload of the next frame and returns the size of its block, zero after the last one.
+    size_t read_frame(bit_reader &reader, std::istream &input_stream, const block_options &options,
+                      std::vector<uint8_t> &payload) {
+        const auto size = reader.read_varint();
+        if (size == 0)
+            return 0;
+        const auto payload_size = reader.read_varint();
+        if (size > options.block_size || payload_size > max_payload_size(size))
+            throw huffman_format_error("invalid block frame");
+
+        // Grows with the bytes read, a frame claiming more than the stream holds fails before the
+        // payload it claims is allocated.
+        payload.clear();
+        for (uint64_t left = payload_size; left != 0;) {
+            const auto offset = payload.size();
+            const auto chunk = static_cast<size_t>(std::min(left, READ_CHUNK_SIZE));
+            payload.resize(offset + chunk);
+            if (!input_stream.read(reinterpret_cast<char *>(payload.data() + offset), chunk))
+                throw huffman_format_error("truncated block");
+            left -= chunk;
+        }
+        return static_cast<size_t>(size);
+    }
+}
+
+namespace {
+    // Covers the raw size too, which the frame stores outside the payload.
+    uint32_t block_checksum(const uint8_t *payload, size_t payload_size, uint64_t size) {
+        std::array<uint8_t, sizeof(uint64_t)> size_bytes{};
+        for (size_t byte = 0; byte < size_bytes.size(); ++byte)
+            size_bytes[byte] = static_cast<uint8_t>(size >> (8 * byte));
+        return crc32c(crc32c(0, size_bytes.data(), size_bytes.size()), payload, payload_size);
+    }
+
+    void append_checksum(encoded_block &block, size_t size) {
+        const auto checksum = block_checksum(block.payload.data(), block.payload.size(), size);
+        for (size_t byte = 0; byte < CHECKSUM_SIZE; ++byte)
+            block.payload.push_back(static_cast<uint8_t>(checksum >> (8 * byte)));
+        block.stats.additional_content_size += CHECKSUM_SIZE;
+    }
+
+    bool is_run(const huffman_tree::char_counter &counter, size_t size) {
+        return std::count(counter.begin(), counter.end(), size) == 1;
+    }
+
+    // The kind with the smallest estimated payload, stored blocks once no coder comes out smaller than
+    // the content. Huffman wins ties with tANS as it decodes faster.
+    block_kind choose_kind(const huffman_tree::char_counter &counter, const huffman_tree::code_lengths &lengths,
+                           const ans_counts &counts, size_t size) {
+        const auto huffman_bits = code_lengths_header_size(lengths) * 8 + coded_bits(counter, lengths);
+        const auto ans_bits = ans_coded_bits(counter, counts);
+        if (std::min(huffman_bits, ans_bits) >= uint64_t(size) * 8)
+            return block_kind::stored;
+        return ans_bits < huffman_bits ? block_kind::ans : block_kind::huffman;
+    }
+
+    void huffman_body(encoded_block &block, const uint8_t *data, size_t size,
+                      const huffman_tree::code_lengths &lengths) {
+        append_code_lengths(block.payload, lengths);
+        block.stats.additional_content_size = block.payload.size();
+
+        const auto codes = make_canonical_codes(lengths);
+        word_bit_writer writer(block.payload);
+        for (const auto *end = data + size; data != end; ++data)
+            writer.write(codes[*data]);
+        writer.finish();
+        block.stats.output_content_size = block.payload.size() - block.stats.additional_content_size;
+    }
+
+    void ans_body(encoded_block &block, const uint8_t *data, size_t size, const ans_counts &counts) {
+        append_ans_counts(block.payload, counts);
+        block.stats.additional_content_size = block.payload.size();
+        append_ans(block.payload, data, size, counts);
+        block.stats.output_content_size = block.payload.size() - block.stats.additional_content_size;
+    }
+
+    void stored_body(encoded_block &block, const uint8_t *data, size_t size) {
+        block.stats.additional_content_size = block.payload.size();
+        block.payload.reserve(block.payload.size() + size + CHECKSUM_SIZE);
+        block.payload.insert(block.payload.end(), data, data + size);
+        block.stats.output_content_size = size;
+    }
+}
+
+// Unchecked blocks keep the layout of format_version::blocks, which knows only Huffman blocks.
+encoded_block encode_block(const uint8_t *data, size_t size, uint8_t max_code_length, bool is_checked) {
+    encoded_block block;
+    block.stats.input_file_size = size;
+
+    const auto counter = count_characters(data, size);
+    if (is_checked && is_run(counter, size)) {
+        block.payload = {static_cast<uint8_t>(block_kind::run), data[0]};
+        block.stats.additional_content_size = block.payload.size();
+        append_checksum(block, size);
+        return block;
+    }
+
+    const auto lengths = build_code_lengths(counter, max_code_length);
+    if (!is_checked) {
+        huffman_body(block, data, size, lengths);
+        return block;
+    }
+
+    const auto counts = normalize_ans_counts(counter, size);
+    const auto kind = choose_kind(counter, lengths, counts, size);
+    block.payload.push_back(static_cast<uint8_t>(kind));
+    if (kind == block_kind::huffman)
+        huffman_body(block, data, size, lengths);
+    else if (kind == block_kind::ans)
+        ans_body(block, data, size, counts);
+    else
+        stored_body(block, data, size);
+    append_checksum(block, size);
+    return block;
+}
+
+statistic decode_block(const uint8_t *payload, size_t payload_size, uint8_t *output, size_t size, bool is_checked) {
+    statistic stats;
+    const auto *data = payload;
+    const auto *end = payload + payload_size;
+
+    // The checksum is compared before anything of the payload is parsed, so only blocks the encoder
+    // wrote, or forged ones, reach the decoders.
+    auto kind = block_kind::huffman;
+    if (is_checked) {
+        if (payload_size < 1 + CHECKSUM_SIZE)
+            throw huffman_format_error("truncated block");
+        end -= CHECKSUM_SIZE;
+        uint32_t expected_checksum = 0;
+        for (size_t byte = 0; byte < CHECKSUM_SIZE; ++byte)
+            expected_checksum |= uint32_t(end[byte]) << (8 * byte);
+        if (block_checksum(payload, end - payload, size) != expected_checksum)
+            throw huffman_format_error("block checksum mismatch");
+        kind = static_cast<block_kind>(*data++);
+        stats.additional_content_size += CHECKSUM_SIZE;
+    }
+
+    if (kind == block_kind::huffman) {
+        const auto lengths = read_code_lengths(data, end);
+        if (!is_complete_code(lengths))
+            throw huffman_format_error("incomplete code lengths");
+        stats.additional_content_size += data - payload;
+
+        const decode_table table(make_canonical_codes(lengths));
+        word_bit_reader bits(data, end - data, stats);
+        table.decode(bits, output, size);
+    } else if (kind == block_kind::ans) {
+        ans_decoder decoder(read_ans_counts(data, end));
+        stats.additional_content_size += data - payload;
+
+        auto bits = decoder.start(data, end - data, stats);
+        decoder.decode(bits, output, size);
+    } else if (kind == block_kind::stored) {
+        if (uint64_t(end - data) != size)
+            throw huffman_format_error("invalid stored block");
+        stats.additional_content_size += data - payload;
+        stats.input_file_size = size;
+        std::memcpy(output, data, size);
+    } else if (kind == block_kind::run) {
+        if (end - data != 1)
+            throw huffman_format_error("invalid run block");
+        stats.additional_content_size += end - payload;
+        std::memset(output, *data, size);
+    } else {
+        throw huffman_format_error("unknown block kind");
+    }
+
+    stats.output_content_size = size;
+    return stats;
+}
+
+block_encoder::block_encoder(block_options options): options(options) {
+    if (options.block_size == 0)
+        throw std::invalid_argument("block size must be positive");
+    if (options.queue_depth == 0 || options.queue_depth > block_options::MAX_QUEUE_DEPTH)
+        throw std::invalid_argument("queue depth must be within [1, " +
+                                    std::to_string(block_options::MAX_QUEUE_DEPTH) + "]");
+    validate_code_length_limit(options.max_code_length);
+}
+
+// `next_block` returns the following block, an empty one once the input is over. At most a window of
+// blocks is in flight and every frame is written as soon as the blocks before it are, so memory stays
+// bounded whatever the input length is.
+template<typename F>
+void block_encoder::encode_frames(std::ostream &output_stream, F &&next_block) {
+    bit_writer writer(output_stream, stats);
+    writer.write_header(options.is_checked ? format_version::checked_blocks : format_version::blocks);
+    writer.write_varint(options.block_size);
+
+    const auto threads = pool_size(options.threads);
+    std::deque<std::pair<size_t, utils::task<encoded_block>>> window;
+    utils::thread_pool pool(threads);
+
+    const auto write_front = [&] {
+        const auto block = window.front().second.get();
+        writer.write_varint(window.front().first);
+        writer.write_varint(block.payload.size());
+        output_stream.write(reinterpret_cast<const char *>(block.payload.data()), block.payload.size());
+        stats += block.stats;
+        window.pop_front();
+    };
+
+    for (block_view block = next_block(); block.size != 0; block = next_block()) {
+        window.emplace_back(block.size, pool.submit([block, options = options] {
+            return encode_block(block.data, block.size, options.max_code_length, options.is_checked);
+        }));
+        while (!window.empty() && (window.size() >= threads * block_options::BLOCKS_PER_THREAD ||
+                                   window.front().second.is_done()))
+            write_front();
+    }
+    while (!window.empty())
+        write_front();
+
+    writer.write_varint(0);
+}
+
+void block_encoder::encode(std::istream &input_stream, std::ostream &output_stream) {
+    encode_frames(output_stream, [&] {
+        auto buffer = std::make_shared<std::vector<uint8_t>>(options.block_size);
+        input_stream.read(reinterpret_cast<char *>(buffer->data()), buffer->size());
+        buffer->resize(input_stream.gcount());
+        return block_view{buffer->data(), buffer->size(), std::move(buffer)};
+    });
+}
+
+void block_encoder::encode(const uint8_t *data, size_t size, std::ostream &output_stream) {
+    size_t position = 0;
+
+    encode_frames(output_stream, [&] {
+        const auto block_size = static_cast<size_t>(std::min<uint64_t>(options.block_size, size - position));
+        const block_view block{data + position, block_size, nullptr};
+        position += block_size;
+        return block;
+    });
+}
+
+void block_encoder::encode_pipelined(std::istream &input_stream, std::ostream &output_stream) {
+    bit_writer writer(output_stream, stats);
+    writer.write_header(options.is_checked ? format_version::checked_blocks : format_version::blocks);
+    writer.write_varint(options.block_size);
+
+    using buffer = std::shared_ptr<std::vector<uint8_t>>;
+    struct pending_block {
+        size_t size;
+        buffer content;
+        utils::task<encoded_block> task;
+    };
+
+    // Buffers are allocated on first use and come back once their block is written.
+    bounded_queue<buffer> free_buffers(options.queue_depth + 1);
+    for (size_t index = 0; index < options.queue_depth + 1; ++index)
+        free_buffers.push(std::make_shared<std::vector<uint8_t>>());
+    bounded_queue<pending_block> encoded(options.queue_depth);
+    utils::thread_pool pool(pool_size(options.threads));
+
+    // A tied stream such as std::cin flushes std::cout on every read, which the reader must not touch.
+    const auto tied_stream = input_stream.tie(nullptr);
+    std::exception_ptr read_error;
+    std::thread reader([&] {
+        try {
+            while (auto content = free_buffers.pop()) {
+                (*content)->resize(options.block_size);
+                input_stream.read(reinterpret_cast<char *>((*content)->data()), (*content)->size());
+                const auto size = static_cast<size_t>(input_stream.gcount());
+                if (size == 0)
+                    break;
+                auto task = pool.submit([content = *content, size, options = options] {
+                    return encode_block(content->data(), size, options.max_code_length, options.is_checked);
+                });
+                if (!encoded.push({size, std::move(*content), std::move(task)}))
+                    break;
+            }
+        } catch (...) {
+            read_error = std::current_exception();
+        }
+        encoded.close();
+    });
+
+    try {
+        while (auto block = encoded.pop()) {
+            const auto result = block->task.get();
+            writer.write_varint(block->size);
+            writer.write_varint(result.payload.size());
+            output_stream.write(reinterpret_cast<const char *>(result.payload.data()), result.payload.size());
+            stats += result.stats;
+            free_buffers.push(std::move(block->content));
+        }
+    } catch (...) {
+        free_buffers.close();
+        encoded.close();
+        reader.join();
+        input_stream.tie(tied_stream);
+        throw;
+    }
+    reader.join();
+    input_stream.tie(tied_stream);
+    if (read_error)
+        std::rethrow_exception(read_error);
+
+    writer.write_varint(0);
+}
+
+void decode_blocks(std::istream &input_stream, std::ostream &output_stream, statistic &stats,
+                   block_options options) {
+    struct decoded_block {
+        std::vector<uint8_t> output;
+        statistic stats;
+    };
+
+    bit_reader reader(input_stream, stats);
+
+    const auto threads = pool_size(options.threads);
+    std::deque<utils::task<decoded_block>> window;
+    utils::thread_pool pool(threads);
+
+    const auto write_front = [&] {
+        const auto block = window.front().get();
+        output_stream.write(reinterpret_cast<const char *>(block.output.data()), block.output.size());
+        stats += block.stats;
+        window.pop_front();
+    };
+
+    while (true) {
+        // Nothing more is buffered, so the next read may wait on a pipe: hand out what is decoded first.
+        if (input_stream.rdbuf()->in_avail() <= 0) {
+            while (!window.empty())
+                write_front();
+            output_stream.flush();
+        }
+
+        std::vector<uint8_t> payload;
+        const auto size = read_frame(reader, input_stream, options, payload);
+        if (size == 0)
+            break;
+
+        window.push_back(pool.submit([payload = std::move(payload), size, is_checked = options.is_checked] {
+            decoded_block block;
+            block.output.resize(size);
+            block.stats = decode_block(payload.data(), payload.size(), block.output.data(), size, is_checked);
+            return block;
+        }));
+        while (!window.empty() && (window.size() >= threads * block_options::BLOCKS_PER_THREAD ||
+                                   window.front().is_done()))
+            write_front();
+    }
+    while (!window.empty())
+        write_front();
+}
+
+block_stream_decoder::block_stream_decoder(std::istream &input_stream, statistic &stats, block_options options)
+    : _input_stream(input_stream), _stats(stats), _reader(input_stream, stats), _options(options) {
+}
+
+size_t block_stream_decoder::decode_next() {
+    const auto size = read_frame(_reader, _input_stream, _options, _payload);
+    _output.resize(size);
+    if (size != 0)
+        _stats += decode_block(_payload.data(), _payload.size(), _output.data(), size, _options.is_checked);
+    return size;
+}
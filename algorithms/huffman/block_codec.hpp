@@ -0,0 +1,108 @@
+#pragma once
+
+#include "huffman.hpp"
+
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Block container: the header is followed by frames of (raw size, payload size, payload), every
+// payload is an independent canonical Huffman block. The frame sizes locate all blocks without
+// decoding them, a zero raw size terminates the stream. Both directions work in a single pass with
+// a bounded number of blocks in memory, so the container also serves pipes of unknown length.
+// Checked payloads start with the block_kind chosen from the histogram and end with the CRC32C of the
+// raw size, as 8 bytes, and the rest of the payload, little-endian. The decoder compares it before it
+// parses the payload, so corrupted blocks fail without running the entropy decoders on them.
+enum class block_kind : uint8_t {
+    // Code lengths and the coded symbols.
+    huffman = 0,
+    // The content as it is, for blocks the codes would not shrink.
+    stored = 1,
+    // The only byte of a block that repeats it.
+    run = 2,
+    // tANS counts and bitstream, for blocks skewed enough to lose on whole-bit codes.
+    ans = 3,
+};
+
+struct block_options {
+    static constexpr uint64_t DEFAULT_BLOCK_SIZE = 1u << 20u;
+    static constexpr size_t BLOCKS_PER_THREAD = 4;
+    static constexpr size_t DEFAULT_QUEUE_DEPTH = 4;
+    // Pools and windows are sized by these, well past any core count.
+    static constexpr size_t MAX_THREADS = 1024;
+    static constexpr size_t MAX_QUEUE_DEPTH = 1024;
+
+    uint64_t block_size = DEFAULT_BLOCK_SIZE;
+    size_t threads = std::thread::hardware_concurrency();
+    uint8_t max_code_length = huffman_tree::MAX_CODE_LENGTH;
+    // Written as format_version::checked_blocks, streams of format_version::blocks have no checksums.
+    bool is_checked = true;
+    // Blocks read ahead of the writer by encode_pipelined, which keeps one buffer more than this.
+    size_t queue_depth = DEFAULT_QUEUE_DEPTH;
+};
+
+struct encoded_block {
+    std::vector<uint8_t> payload;
+    statistic stats;
+};
+
+encoded_block encode_block(const uint8_t *data, size_t size, uint8_t max_code_length = huffman_tree::MAX_CODE_LENGTH,
+                           bool is_checked = true);
+// Throws huffman_format_error for checked blocks that do not match their checksum and for payloads
+// no encoder writes.
+statistic decode_block(const uint8_t *payload, size_t payload_size, uint8_t *output, size_t size,
+                       bool is_checked = true);
+
+class block_encoder final {
+public:
+    // Throws std::invalid_argument for a zero block size, a queue depth outside [1, MAX_QUEUE_DEPTH]
+    // or a code length limit outside [8, 64].
+    explicit block_encoder(block_options options = {});
+
+    void encode(std::istream &input_stream, std::ostream &output_stream);
+    void encode(const uint8_t *data, size_t size, std::ostream &output_stream);
+    // Same output as encode(), but a thread of its own reads blocks into recycled buffers while the
+    // pool encodes the ones before and the calling thread writes them, so reading, coding and writing
+    // overlap. Memory is bounded by queue_depth + 1 buffers of block_size.
+    void encode_pipelined(std::istream &input_stream, std::ostream &output_stream);
+
+    statistic stats;
+    block_options options;
+
+private:
+    struct block_view {
+        const uint8_t *data;
+        size_t size;
+        // Owns blocks read from a stream until their task is over.
+        std::shared_ptr<const std::vector<uint8_t>> storage;
+    };
+
+    template<typename F>
+    void encode_frames(std::ostream &output_stream, F &&next_block);
+};
+
+// Decodes the frames that follow an already consumed container header.
+void decode_blocks(std::istream &input_stream, std::ostream &output_stream, statistic &stats, block_options options);
+
+// Decodes the same frames a block at a time on the calling thread, for callers that pull the content.
+class block_stream_decoder final {
+public:
+    block_stream_decoder(std::istream &input_stream, statistic &stats, block_options options);
+
+    // Returns the size of the next block, zero after the last one; output() holds it until the next call.
+    size_t decode_next();
+
+    [[nodiscard]] const uint8_t *output() const noexcept { return _output.data(); }
+
+private:
+    std::istream &_input_stream;
+    statistic &_stats;
+    bit_reader _reader;
+    block_options _options;
+    std::vector<uint8_t> _payload;
+    std::vector<uint8_t> _output;
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+// Connects the stages of a pipeline: producers wait while `capacity` items are queued and consumers
+// while none are. Once closed, pushes are refused and pops drain what is left, so either side can
+// stop the other.
+template<typename T>
+class bounded_queue final {
+public:
+    explicit bounded_queue(size_t capacity): _capacity(std::max<size_t>(capacity, 1)) {}
+
+    // False once the queue is closed, the item is dropped then.
+    bool push(T item) {
+        std::unique_lock lock(_mutex);
+        _not_full.wait(lock, [&] { return _items.size() < _capacity || _is_closed; });
+        if (_is_closed)
+            return false;
+        _items.push_back(std::move(item));
+        lock.unlock();
+        _not_empty.notify_one();
+        return true;
+    }
+
+    // Empty once the queue is closed and drained.
+    std::optional<T> pop() {
+        std::unique_lock lock(_mutex);
+        _not_empty.wait(lock, [&] { return !_items.empty() || _is_closed; });
+        if (_items.empty())
+            return {};
+        std::optional<T> item(std::move(_items.front()));
+        _items.pop_front();
+        lock.unlock();
+        _not_full.notify_one();
+        return item;
+    }
+
+    void close() {
+        {
+            std::lock_guard lock(_mutex);
+            _is_closed = true;
+        }
+        _not_full.notify_all();
+        _not_empty.notify_all();
+    }
+
+private:
+    size_t _capacity;
+    std::deque<T> _items;
+    std::mutex _mutex;
+    std::condition_variable _not_full;
+    std::condition_variable _not_empty;
+    bool _is_closed = false;
+};
@@ -0,0 +1,325 @@
+#include "buffer_codec.hpp"
+#include "block_codec.hpp"
+#include "dictionary.hpp"
+#include "lz77_codec.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+    constexpr size_t MAX_VARINT_SIZE = 10;
+
+    bool is_same_code(const huffman_code &lhs, const huffman_code &rhs) {
+        return lhs.bits == rhs.bits && lhs.length == rhs.length;
+    }
+
+    // Bounds a claimed count by the bytes left before anyone allocates for it, `per_byte` is the most
+    // symbols a byte of them decodes to.
+    void check_symbols_count(uint64_t symbols_count, uint64_t per_byte, const uint8_t *data, const uint8_t *end) {
+        if (symbols_count / per_byte > uint64_t(end - data))
+            throw huffman_format_error("truncated stream");
+    }
+
+    // word_bit_writer over the caller's buffer, which the payload goes to without a copy.
+    class buffer_bit_writer {
+    public:
+        buffer_bit_writer(uint8_t *output, const uint8_t *end) noexcept: _position(output), _end(end) {}
+
+        void write(const huffman_code &code) {
+            write(code.bits, code.length);
+        }
+
+        void write(uint64_t bits, uint8_t length) {
+            if (length > 32) {
+                write(bits >> 32u, length - 32);
+                bits &= 0xffffffffu;
+                length = 32;
+            }
+
+            _buffer = _buffer << length | bits;
+            _count += length;
+            if (_count >= 32) {
+                _count -= 32;
+                reserve(sizeof(uint32_t));
+                const auto word = static_cast<uint32_t>(_buffer >> _count);
+                for (uint8_t shift = 32; shift > 0;) {
+                    shift -= 8;
+                    *_position++ = static_cast<uint8_t>(word >> shift);
+                }
+            }
+        }
+
+        // Pads the last byte with zeros and returns the end of the written bytes.
+        uint8_t *finish() {
+            reserve((_count + 7) / 8);
+            for (; _count >= 8; _count -= 8)
+                *_position++ = static_cast<uint8_t>(_buffer >> (_count - 8));
+            if (_count != 0) {
+                *_position++ = static_cast<uint8_t>(_buffer << (8 - _count));
+                _count = 0;
+            }
+            return _position;
+        }
+
+    private:
+        void reserve(size_t size) const {
+            if (size_t(_end - _position) < size)
+                throw std::length_error("output buffer is too small");
+        }
+
+        uint8_t *_position;
+        const uint8_t *_end;
+        uint64_t _buffer = 0;
+        uint8_t _count = 0;
+    };
+
+    // Block and adaptive frames share the layout, `max_size` bounds the symbols of a frame.
+    template<typename F>
+    void for_each_frame(const uint8_t *data, const uint8_t *end, uint64_t max_size, F &&function) {
+        while (true) {
+            const auto size = read_varint(data, end);
+            if (size == 0)
+                return;
+            const auto payload_size = read_varint(data, end);
+            if (size > max_size || payload_size > uint64_t(end - data))
+                throw huffman_format_error("invalid frame");
+
+            function(data, static_cast<size_t>(payload_size), size);
+            data += payload_size;
+        }
+    }
+}
+
+// Single bytes may get codes of up to 64 bits, the bound holds for the payload as a whole: the fixed
+// 8-bit code fits every limit of at least 8 bits, and the optimal or package-merge code for the counts
+// never costs more in total than it does, so the payload is at most the input size.
+size_t huffman_context::max_compressed_size(size_t size) {
+    constexpr size_t header_size = FORMAT_MAGIC.size() + 1 + MAX_VARINT_SIZE + huffman_tree::CHARACTERS_COUNT;
+    if (size > SIZE_MAX - header_size)
+        throw std::length_error("input is too large");
+    return header_size + size;
+}
+
+size_t huffman_context::max_compressed_size(size_t size, const huffman_dictionary &dictionary) {
+    constexpr size_t header_size = FORMAT_MAGIC.size() + 1 + 2 * MAX_VARINT_SIZE;
+    if (size > (SIZE_MAX - 7) / dictionary.max_code_length())
+        throw std::length_error("input is too large");
+    return header_size + (size * dictionary.max_code_length() + 7) / 8;
+}
+
+huffman_context::header huffman_context::read_header(const uint8_t *&data, const uint8_t *end) {
+    header result;
+    if (size_t(end - data) < FORMAT_MAGIC.size() + 1)
+        throw huffman_format_error("truncated header");
+
+    if (!std::equal(FORMAT_MAGIC.begin(), FORMAT_MAGIC.end(), reinterpret_cast<const char *>(data))) {
+        huffman_tree::char_counter counter;
+        if (size_t(end - data) < sizeof(uint32_t) * counter.size())
+            throw huffman_format_error("truncated frequency table");
+        for (auto &value : counter) {
+            uint32_t count = 0;
+            std::memcpy(&count, data, sizeof(count));
+            value = count;
+            data += sizeof(count);
+        }
+
+        result.format = format_version::legacy;
+        result.codes = huffman_tree::legacy(counter).build_code_table();
+        for (const auto value : counter)
+            result.symbols_count += value;
+        check_symbols_count(result.symbols_count, 8, data, end);
+        return result;
+    }
+
+    data += FORMAT_MAGIC.size();
+    result.format = static_cast<format_version>(*data++);
+    if (is_block_format(result.format)) {
+        result.block_size = read_varint(data, end);
+        return result;
+    }
+    if (result.format == format_version::adaptive) {
+        result.adaptive.rebuild_interval = read_varint(data, end);
+        const auto max_code_length = read_varint(data, end);
+        result.adaptive.max_code_length = static_cast<uint8_t>(std::min<uint64_t>(max_code_length, UINT8_MAX));
+        adaptive_decoder::check_options(result.adaptive);
+        return result;
+    }
+    if (result.format == format_version::dictionary) {
+        result.dictionary_id = static_cast<uint32_t>(read_varint(data, end));
+        result.symbols_count = read_varint(data, end);
+        // Every code takes at least a bit.
+        check_symbols_count(result.symbols_count, 8, data, end);
+        return result;
+    }
+    if (result.format == format_version::order1) {
+        result.symbols_count = read_varint(data, end);
+        result.order1 = read_order1_tables(data, end);
+        check_symbols_count(result.symbols_count, 8, data, end);
+        return result;
+    }
+    if (result.format == format_version::lz77) {
+        result.symbols_count = read_varint(data, end);
+        // A block starts with three varints and decodes to at most BLOCK_SIZE bytes.
+        check_symbols_count(result.symbols_count, lz77_encoder::BLOCK_SIZE / 3, data, end);
+        return result;
+    }
+    if (result.format != format_version::canonical && result.format != format_version::interleaved &&
+        result.format != format_version::indexed)
+        throw huffman_format_error("unsupported format version");
+
+    result.symbols_count = read_varint(data, end);
+    // A full decode runs through the blocks in order and never needs their index.
+    if (result.format == format_version::indexed)
+        result.block_size = read_varint(data, end);
+    result.codes = make_canonical_codes(read_code_lengths(data, end));
+    if (result.symbols_count != 0 &&
+        std::all_of(result.codes.begin(), result.codes.end(), [](const auto &code) { return code.length == 0; }))
+        throw huffman_format_error("no codes for the symbols");
+    check_symbols_count(result.symbols_count, 8, data, end);
+    return result;
+}
+
+uint64_t huffman_context::decompressed_size(const uint8_t *input, size_t input_size) {
+    const auto *end = input + input_size;
+    const auto header = read_header(input, end);
+    if (!is_block_format(header.format) && header.format != format_version::adaptive)
+        return header.symbols_count;
+
+    const auto max_size = is_block_format(header.format) ? header.block_size : adaptive_encoder::FRAME_SIZE;
+    uint64_t size = 0;
+    for_each_frame(input, end, max_size, [&](const uint8_t *, size_t, uint64_t block_size) {
+        size += block_size;
+    });
+    return size;
+}
+
+size_t huffman_context::compress(const uint8_t *input, size_t input_size, uint8_t *output, size_t output_capacity,
+                                 uint8_t max_code_length) {
+    const auto lengths = build_code_lengths(count_characters(input, input_size), max_code_length);
+
+    start_header(format_version::canonical);
+    append_varint(_scratch, input_size);
+    append_code_lengths(_scratch, lengths);
+    return write_payload(input, input_size, make_canonical_codes(lengths), output, output_capacity);
+}
+
+size_t huffman_context::compress(const uint8_t *input, size_t input_size, uint8_t *output, size_t output_capacity,
+                                 const huffman_dictionary &dictionary) {
+    start_header(format_version::dictionary);
+    append_varint(_scratch, dictionary.id());
+    append_varint(_scratch, input_size);
+    return write_payload(input, input_size, dictionary.codes(), output, output_capacity);
+}
+
+void huffman_context::start_header(format_version format) {
+    _scratch.clear();
+    for (const auto character : FORMAT_MAGIC)
+        _scratch.push_back(static_cast<uint8_t>(character));
+    _scratch.push_back(static_cast<uint8_t>(format));
+}
+
+size_t huffman_context::write_payload(const uint8_t *input, size_t input_size, const huffman_tree::code_table &codes,
+                                      uint8_t *output, size_t output_capacity) {
+    stats = {};
+    stats.input_file_size = input_size;
+    stats.additional_content_size = _scratch.size();
+    if (_scratch.size() > output_capacity)
+        throw std::length_error("output buffer is too small");
+    std::memcpy(output, _scratch.data(), _scratch.size());
+
+    buffer_bit_writer writer(output + _scratch.size(), output + output_capacity);
+    for (const auto *end = input + input_size; input != end; ++input)
+        writer.write(codes[*input]);
+    const auto size = static_cast<size_t>(writer.finish() - output);
+    stats.output_content_size = size - stats.additional_content_size;
+    return size;
+}
+
+size_t huffman_context::decompress(const uint8_t *input, size_t input_size, uint8_t *output, size_t output_capacity) {
+    return decompress(input, input_size, output, output_capacity, nullptr);
+}
+
+size_t huffman_context::decompress(const uint8_t *input, size_t input_size, uint8_t *output, size_t output_capacity,
+                                   const huffman_dictionary &dictionary) {
+    return decompress(input, input_size, output, output_capacity, &dictionary);
+}
+
+size_t huffman_context::decompress(const uint8_t *input, size_t input_size, uint8_t *output, size_t output_capacity,
+                                   const huffman_dictionary *dictionary) {
+    stats = {};
+    const auto *data = input;
+    const auto *end = input + input_size;
+    const auto header = read_header(data, end);
+    stats.additional_content_size = data - input;
+
+    if (is_block_format(header.format)) {
+        const auto is_checked = header.format == format_version::checked_blocks;
+        size_t size = 0;
+        for_each_frame(data, end, header.block_size, [&](const uint8_t *payload, size_t payload_size,
+                                                          uint64_t block_size) {
+            if (block_size > output_capacity - size)
+                throw std::length_error("output buffer is too small");
+            stats += decode_block(payload, payload_size, output + size, block_size, is_checked);
+            size += block_size;
+        });
+        return size;
+    }
+    if (header.format == format_version::adaptive) {
+        adaptive_decoder decoder(header.adaptive);
+        size_t size = 0;
+        for_each_frame(data, end, adaptive_encoder::FRAME_SIZE, [&](const uint8_t *payload, size_t payload_size,
+                                                                    uint64_t count) {
+            if (count > output_capacity - size)
+                throw std::length_error("output buffer is too small");
+            if (payload_size > adaptive_decoder::max_payload_size(count, header.adaptive))
+                throw huffman_format_error("invalid frame");
+            decoder.decode_frame(payload, payload_size, output + size, count, stats);
+            size += count;
+        });
+        return size;
+    }
+
+    if (header.symbols_count > output_capacity)
+        throw std::length_error("output buffer is too small");
+
+    if (header.format == format_version::dictionary) {
+        if (dictionary == nullptr || dictionary->id() != header.dictionary_id)
+            throw huffman_format_error("the stream needs dictionary " + std::to_string(header.dictionary_id));
+        word_bit_reader bits(data, end - data, stats);
+        dictionary->table().decode(bits, output, header.symbols_count);
+        stats.output_content_size = header.symbols_count;
+        return header.symbols_count;
+    }
+    if (header.format == format_version::order1) {
+        word_bit_reader bits(data, end - data, stats);
+        order1_decoder(header.order1).decode(bits, output, header.symbols_count);
+        stats.output_content_size = header.symbols_count;
+        return header.symbols_count;
+    }
+    if (header.format == format_version::lz77) {
+        // The output is the history, matches are copied straight out of it.
+        size_t size = 0;
+        while (size < header.symbols_count) {
+            const auto capacity = static_cast<size_t>(std::min<uint64_t>(header.symbols_count - size,
+                                                                         lz77_encoder::BLOCK_SIZE));
+            size += decode_lz77_block(data, end, output, output + size, capacity, stats);
+        }
+        return size;
+    }
+
+    if (_table.empty() || !std::equal(_codes.begin(), _codes.end(), header.codes.begin(), is_same_code)) {
+        _codes = header.codes;
+        _table = decode_table(_codes);
+    }
+
+    if (header.format == format_version::interleaved) {
+        auto bits = open_interleaved(data, end, stats);
+        _table.decode(bits, output, header.symbols_count);
+    } else {
+        word_bit_reader bits(data, end - data, stats);
+        _table.decode(bits, output, header.symbols_count);
+    }
+    stats.output_content_size = header.symbols_count;
+    return header.symbols_count;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "adaptive_codec.hpp"
+#include "huffman.hpp"
+#include "order1_codec.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class huffman_dictionary;
+
+// Compression of contiguous buffers without streams. The payload is coded straight into the output,
+// the context keeps a scratch buffer for the header and the decode table of the last message, so
+// repeated calls on similar messages do not allocate.
+class huffman_context final {
+public:
+    // Output capacity that fits the compression of any `size` bytes, throws std::length_error when it
+    // does not fit size_t.
+    [[nodiscard]] static size_t max_compressed_size(size_t size);
+    [[nodiscard]] static size_t max_compressed_size(size_t size, const huffman_dictionary &dictionary);
+
+    // Size of the content a compressed buffer decodes to, taken from its headers.
+    [[nodiscard]] static uint64_t decompressed_size(const uint8_t *input, size_t input_size);
+
+    // Writes the canonical format and returns its size, throws std::length_error when the output is too small.
+    size_t compress(const uint8_t *input, size_t input_size, uint8_t *output, size_t output_capacity,
+                    uint8_t max_code_length = huffman_tree::MAX_CODE_LENGTH);
+    // Codes with the dictionary, the header holds only its ID and the size.
+    size_t compress(const uint8_t *input, size_t input_size, uint8_t *output, size_t output_capacity,
+                    const huffman_dictionary &dictionary);
+
+    // Reads every format huffman_decoder does and returns the decompressed size, streams written
+    // with a dictionary need the same one.
+    size_t decompress(const uint8_t *input, size_t input_size, uint8_t *output, size_t output_capacity);
+    size_t decompress(const uint8_t *input, size_t input_size, uint8_t *output, size_t output_capacity,
+                      const huffman_dictionary &dictionary);
+
+    // Of the last call.
+    statistic stats;
+
+private:
+    struct header {
+        format_version format = format_version::canonical;
+        uint64_t symbols_count = 0;
+        uint64_t block_size = 0;
+        uint32_t dictionary_id = 0;
+        adaptive_options adaptive;
+        order1_tables order1;
+        huffman_tree::code_table codes;
+    };
+
+    static header read_header(const uint8_t *&data, const uint8_t *end);
+
+    void start_header(format_version format);
+    size_t write_payload(const uint8_t *input, size_t input_size, const huffman_tree::code_table &codes,
+                         uint8_t *output, size_t output_capacity);
+    size_t decompress(const uint8_t *input, size_t input_size, uint8_t *output, size_t output_capacity,
+                      const huffman_dictionary *dictionary);
+
+    std::vector<uint8_t> _scratch;
+    huffman_tree::code_table _codes;
+    decode_table _table;
+};
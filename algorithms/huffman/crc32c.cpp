@@ -0,0 +1,88 @@
+#include "crc32c.hpp"
+
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC32C_X86 1
+#endif
+
+namespace {
+    constexpr uint32_t POLYNOMIAL = 0x82f63b78u;
+
+    using crc_tables = std::array<std::array<uint32_t, 256>, 8>;
+
+    // tables[n][byte] advances the CRC of `byte` over n more zero bytes, so eight bytes are folded at once.
+    constexpr crc_tables make_tables() {
+        crc_tables tables{};
+        for (uint32_t byte = 0; byte < 256; ++byte) {
+            auto crc = byte;
+            for (int bit = 0; bit < 8; ++bit)
+                crc = (crc >> 1u) ^ (crc & 1u ? POLYNOMIAL : 0);
+            tables[0][byte] = crc;
+        }
+        for (size_t table = 1; table < tables.size(); ++table) {
+            for (size_t byte = 0; byte < 256; ++byte)
+                tables[table][byte] = (tables[table - 1][byte] >> 8u) ^ tables[0][tables[table - 1][byte] & 0xffu];
+        }
+        return tables;
+    }
+
+    constexpr auto TABLES = make_tables();
+
+    inline uint64_t load_word(const uint8_t *data) {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        return word;
+    }
+}
+
+uint32_t crc32c_software(uint32_t crc, const uint8_t *data, size_t size) {
+    crc = ~crc;
+    const auto *end = data + size;
+    for (; end - data >= 8; data += 8) {
+        const auto word = load_word(data) ^ crc;
+        crc = TABLES[7][word & 0xffu] ^ TABLES[6][(word >> 8u) & 0xffu] ^
+              TABLES[5][(word >> 16u) & 0xffu] ^ TABLES[4][(word >> 24u) & 0xffu] ^
+              TABLES[3][(word >> 32u) & 0xffu] ^ TABLES[2][(word >> 40u) & 0xffu] ^
+              TABLES[1][(word >> 48u) & 0xffu] ^ TABLES[0][word >> 56u];
+    }
+    for (; data != end; ++data)
+        crc = (crc >> 8u) ^ TABLES[0][(crc ^ *data) & 0xffu];
+    return ~crc;
+}
+
+#ifdef CRC32C_X86
+
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t size) {
+    uint64_t state = ~crc;
+    const auto *end = data + size;
+    for (; end - data >= 8; data += 8)
+        state = _mm_crc32_u64(state, load_word(data));
+    for (; data != end; ++data)
+        state = _mm_crc32_u8(static_cast<uint32_t>(state), *data);
+    return ~static_cast<uint32_t>(state);
+}
+
+bool has_sse42() noexcept {
+    static const bool is_supported = __builtin_cpu_supports("sse4.2");
+    return is_supported;
+}
+
+#else
+
+uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t size) {
+    return crc32c_software(crc, data, size);
+}
+
+bool has_sse42() noexcept {
+    return false;
+}
+
+#endif
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t size) {
+    return has_sse42() ? crc32c_sse42(crc, data, size) : crc32c_software(crc, data, size);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC-32C (Castagnoli, as in iSCSI and ext4). `crc` is the value of the data before the buffer,
+// zero to start, so a buffer can be checked in pieces while they are at hand.
+[[nodiscard]] uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t size);
+
+[[nodiscard]] uint32_t crc32c_software(uint32_t crc, const uint8_t *data, size_t size);
+[[nodiscard]] uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t size);
+
+[[nodiscard]] bool has_sse42() noexcept;
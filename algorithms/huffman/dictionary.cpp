@@ -0,0 +1,52 @@
+#include "dictionary.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <vector>
+
+namespace {
+    // FNV-1a of the code lengths, the ID changes whenever the codes do.
+    uint32_t dictionary_id(const huffman_tree::code_lengths &lengths) {
+        uint32_t hash = 2166136261u;
+        for (const auto length : lengths) {
+            hash ^= length;
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+}
+
+huffman_dictionary::huffman_dictionary(const huffman_tree::code_lengths &lengths)
+    : _lengths(lengths),
+      _codes(make_canonical_codes(lengths)),
+      _table(_codes),
+      _id(dictionary_id(lengths)),
+      _max_code_length(*std::max_element(lengths.begin(), lengths.end())) {
+}
+
+huffman_dictionary huffman_dictionary::train(const huffman_tree::char_counter &counter, uint8_t max_code_length) {
+    auto smoothed = counter;
+    for (auto &count : smoothed)
+        count = count == std::numeric_limits<uint64_t>::max() ? count : count + 1;
+    return huffman_dictionary(build_code_lengths(smoothed, max_code_length));
+}
+
+huffman_dictionary huffman_dictionary::load(std::istream &stream) {
+    std::array<char, MAGIC.size()> magic{};
+    if (!stream.read(magic.data(), magic.size()) || magic != MAGIC)
+        throw huffman_format_error("not a dictionary");
+
+    const std::vector<uint8_t> content(std::istreambuf_iterator<char>(stream), {});
+    const auto *data = content.data();
+    const auto lengths = read_code_lengths(data, content.data() + content.size());
+    if (std::find(lengths.begin(), lengths.end(), 0) != lengths.end())
+        throw huffman_format_error("the dictionary lacks codes");
+    return huffman_dictionary(lengths);
+}
+
+void huffman_dictionary::save(std::ostream &stream) const {
+    std::vector<uint8_t> content(MAGIC.begin(), MAGIC.end());
+    append_code_lengths(content, _lengths);
+    stream.write(reinterpret_cast<const char *>(content.data()), content.size());
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "huffman.hpp"
+
+#include <array>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+
+// Code table trained offline on sample data. Streams written with it carry the dictionary ID in
+// place of code lengths, so short messages skip both the header and building the codes.
+class huffman_dictionary final {
+public:
+    static constexpr std::array<char, 4> MAGIC = {'\x89', 'H', 'U', 'D'};
+
+    // Every byte gets a code, the ones missing from the samples too.
+    [[nodiscard]] static huffman_dictionary train(const huffman_tree::char_counter &counter,
+                                                  uint8_t max_code_length = huffman_tree::MAX_CODE_LENGTH);
+
+    // Throws huffman_format_error for anything but a complete dictionary.
+    [[nodiscard]] static huffman_dictionary load(std::istream &stream);
+    void save(std::ostream &stream) const;
+
+    [[nodiscard]] uint32_t id() const noexcept { return _id; }
+
+    [[nodiscard]] uint8_t max_code_length() const noexcept { return _max_code_length; }
+
+    [[nodiscard]] const huffman_tree::code_lengths &lengths() const noexcept { return _lengths; }
+
+    [[nodiscard]] const huffman_tree::code_table &codes() const noexcept { return _codes; }
+
+    [[nodiscard]] const decode_table &table() const noexcept { return _table; }
+
+private:
+    explicit huffman_dictionary(const huffman_tree::code_lengths &lengths);
+
+    huffman_tree::code_lengths _lengths;
+    huffman_tree::code_table _codes;
+    decode_table _table;
+    uint32_t _id = 0;
+    uint8_t _max_code_length = 0;
+};
@@ -0,0 +1,139 @@
+#include "histogram.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HISTOGRAM_X86 1
+#endif
+
+namespace {
+    // 32-bit counters keep the four sub-histograms in 4 KiB of L1. They count at most a slice of the
+    // input before they are added to the histogram, so they never wrap.
+    using sub_histograms = std::array<std::array<uint32_t, 256>, 4>;
+    constexpr size_t SLICE_SIZE = size_t(1) << 30u;
+
+    template<typename F>
+    void for_each_slice(const uint8_t *data, size_t size, F &&count_slice) {
+        for (const auto *end = data + size; data != end;) {
+            const auto slice_size = std::min<size_t>(end - data, SLICE_SIZE);
+            count_slice(data, data + slice_size);
+            data += slice_size;
+        }
+    }
+
+    // Neighbouring bytes of the word go to different sub-histograms.
+    inline void add_word(sub_histograms &counters, uint64_t word) {
+        ++counters[0][word & 0xffu];
+        ++counters[1][(word >> 8u) & 0xffu];
+        ++counters[2][(word >> 16u) & 0xffu];
+        ++counters[3][(word >> 24u) & 0xffu];
+        ++counters[0][(word >> 32u) & 0xffu];
+        ++counters[1][(word >> 40u) & 0xffu];
+        ++counters[2][(word >> 48u) & 0xffu];
+        ++counters[3][word >> 56u];
+    }
+
+    inline uint64_t load_word(const uint8_t *data) {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        return word;
+    }
+
+    void finish(sub_histograms &counters, const uint8_t *data, const uint8_t *end, byte_histogram &histogram) {
+        for (; data != end; ++data)
+            ++counters[0][*data];
+        for (size_t character = 0; character < histogram.size(); ++character)
+            histogram[character] += counters[0][character] + counters[1][character] + counters[2][character] +
+                                    counters[3][character];
+    }
+}
+
+void accumulate_histogram_scalar(const uint8_t *data, size_t size, byte_histogram &histogram) {
+    for_each_slice(data, size, [&](const uint8_t *data, const uint8_t *end) {
+        sub_histograms counters{};
+        for (; end - data >= 16; data += 16) {
+            add_word(counters, load_word(data));
+            add_word(counters, load_word(data + 8));
+        }
+        finish(counters, data, end, histogram);
+    });
+}
+
+#ifdef HISTOGRAM_X86
+
+namespace {
+    // Vectors of a single repeated byte, the worst case for the increments, are counted at once. A
+    // lambda would not inherit the target, so the slices are counted here.
+    __attribute__((target("avx2")))
+    void count_slice_avx2(const uint8_t *data, const uint8_t *end, byte_histogram &histogram) {
+        sub_histograms counters{};
+        for (; end - data >= 32; data += 32) {
+            const auto block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+            const auto first = _mm256_set1_epi8(static_cast<char>(data[0]));
+            if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, first)) == -1) {
+                counters[0][data[0]] += 32;
+                continue;
+            }
+
+            add_word(counters, load_word(data));
+            add_word(counters, load_word(data + 8));
+            add_word(counters, load_word(data + 16));
+            add_word(counters, load_word(data + 24));
+        }
+        finish(counters, data, end, histogram);
+    }
+}
+
+void accumulate_histogram_avx2(const uint8_t *data, size_t size, byte_histogram &histogram) {
+    for_each_slice(data, size, [&](const uint8_t *data, const uint8_t *end) {
+        count_slice_avx2(data, end, histogram);
+    });
+}
+
+bool has_avx2() noexcept {
+    static const bool is_supported = __builtin_cpu_supports("avx2");
+    return is_supported;
+}
+
+#else
+
+void accumulate_histogram_avx2(const uint8_t *data, size_t size, byte_histogram &histogram) {
+    accumulate_histogram_scalar(data, size, histogram);
+}
+
+bool has_avx2() noexcept {
+    return false;
+}
+
+#endif
+
+namespace {
+    // The AVX2 kernel counts runs three times as fast and everything else a few percent slower, so
+    // every chunk goes to it only when runs fill an eighth of the vectors at its start.
+    constexpr size_t DISPATCH_CHUNK_SIZE = size_t(1) << 20u;
+    constexpr size_t PROBE_SIZE = 4096;
+
+    bool has_runs(const uint8_t *data, size_t size) {
+        size_t vectors = 0;
+        size_t runs = 0;
+        for (const auto *end = data + std::min(size, PROBE_SIZE); end - data >= 32; data += 32, ++vectors) {
+            const auto word = load_word(data);
+            runs += word == (word & 0xffu) * 0x0101010101010101u && word == load_word(data + 8) &&
+                    word == load_word(data + 16) && word == load_word(data + 24);
+        }
+        return vectors != 0 && runs * 8 >= vectors;
+    }
+}
+
+void accumulate_histogram(const uint8_t *data, size_t size, byte_histogram &histogram) {
+    for (const auto *end = data + size; data != end;) {
+        const auto chunk_size = std::min<size_t>(end - data, DISPATCH_CHUNK_SIZE);
+        if (has_avx2() && has_runs(data, chunk_size))
+            accumulate_histogram_avx2(data, chunk_size, histogram);
+        else
+            accumulate_histogram_scalar(data, chunk_size, histogram);
+        data += chunk_size;
+    }
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Same type as huffman_tree::char_counter. The counts take 64 bits, mapped files and pipes may bring
+// more than 4 GiB of one byte.
+using byte_histogram = std::array<uint64_t, 256>;
+
+// Adds the bytes of the buffer to the histogram. Chunks that start with runs of a byte go to the AVX2
+// kernel where the CPU supports it, the rest to the scalar one, which is faster on them.
+void accumulate_histogram(const uint8_t *data, size_t size, byte_histogram &histogram);
+
+// The kernels spread consecutive bytes over interleaved sub-histograms, so runs of the same byte
+// do not wait for their own previous increments to be stored.
+void accumulate_histogram_scalar(const uint8_t *data, size_t size, byte_histogram &histogram);
+void accumulate_histogram_avx2(const uint8_t *data, size_t size, byte_histogram &histogram);
+
+[[nodiscard]] bool has_avx2() noexcept;
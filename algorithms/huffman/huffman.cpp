@@ -1,78 +1,180 @@
 #include "huffman.hpp"
+#include "adaptive_codec.hpp"
+#include "block_codec.hpp"
+#include "histogram.hpp"
+#include "lz77_codec.hpp"
+#include "order1_codec.hpp"
 
 #include <utility>
 #include <vector>
-#include <queue>
 #include <ostream>
 #include <istream>
+#include <iterator>
 #include <algorithm>
+#include <charconv>
 #include <cstring>
+#include <map>
+#include <memory>
+#include <optional>
+#include <type_traits>
 
 bit_reader::bit_reader(std::istream &stream, statistic &stat)
     : stream(stream), stat(stat) {
 }
 
-huffman_tree::char_counter bit_reader::read_counter() {
-    huffman_tree::char_counter counter;
-    const auto size = sizeof(uint32_t);
-    for (auto &element : counter) {
+huffman_tree::char_counter bit_reader::read_counter(size_t from) {
+    huffman_tree::char_counter counter{};
+    for (auto offset = from; offset < counter.size(); ++offset) {
+        uint32_t count = 0;
+        if (!stream.read(reinterpret_cast<char *>(&count), sizeof(count)))
+            throw huffman_format_error("truncated frequency table");
+        counter[offset] = count;
+    }
+    return counter;
+}
 
-        char bytes[size];
-        stream.read(bytes, size);
+uint8_t bit_reader::read_byte() {
+    char byte = 0;
+    if (!stream.read(&byte, 1))
+        throw huffman_format_error("truncated header");
+    ++stat.additional_content_size;
+    return static_cast<uint8_t>(byte);
+}
 
-        memcpy(&element, bytes, size);
+namespace {
+    template<typename F>
+    uint64_t parse_varint(F &&next_byte) {
+        uint64_t value = 0;
+        for (uint8_t shift = 0; shift < 64; shift += 7) {
+            const uint8_t byte = next_byte();
+            value |= uint64_t(byte & 0x7fu) << shift;
+            if ((byte & 0x80u) == 0)
+                return value;
+        }
+        throw huffman_format_error("malformed varint");
     }
-    return counter;
+
+    template<typename F>
+    huffman_tree::code_lengths parse_code_lengths(F &&next_byte) {
+        huffman_tree::code_lengths lengths{};
+        for (size_t symbol = 0; symbol < lengths.size();) {
+            const uint8_t byte = next_byte();
+            if (byte & 0x80u) {
+                symbol += (byte & 0x7fu) + 1u;
+                continue;
+            }
+            if (byte == 0 || byte > huffman_tree::MAX_CODE_LENGTH)
+                throw huffman_format_error("invalid code length");
+            lengths[symbol++] = byte;
+        }
+        return lengths;
+    }
+}
+
+uint64_t bit_reader::read_varint() {
+    return parse_varint([this] { return read_byte(); });
 }
 
-std::optional<char> bit_reader::read_huffman_char(const huffman_tree &tree) {
+uint64_t read_varint(const uint8_t *&data, const uint8_t *end) {
+    return parse_varint([&data, end] {
+        if (data == end)
+            throw huffman_format_error("truncated varint");
+        return *data++;
+    });
+}
+
+huffman_tree::code_lengths bit_reader::read_code_lengths() {
+    return parse_code_lengths([this] { return read_byte(); });
+}
+
+huffman_tree::code_lengths read_code_lengths(const uint8_t *&data, const uint8_t *end) {
+    return parse_code_lengths([&data, end] {
+        if (data == end)
+            throw huffman_format_error("truncated code lengths");
+        return *data++;
+    });
+}
+
+bool bit_reader::read_bit() {
     if (_bit_offset < 0) {
         char c = 0;
         if (!stream.read(&c, 1))
-            return {};
+            throw huffman_format_error("truncated stream");
         ++stat.input_file_size;
 
         buffer = c;
-
         _bit_offset = MAX_BIT_OFFSET;
     }
+    return buffer >> _bit_offset-- & 1u; // NOLINT(hicpp-signed-bitwise)
+}
 
-    for (; current_node && _bit_offset >= 0;) {
-        if (current_node->is_leaf()) {
-            if (current_node->count == 0) {
-                return {};
-            }
-            auto character = current_node->data;
-            --current_node->count;
-            current_node = tree.root;
+uint8_t bit_reader::read_huffman_char(const huffman_tree &tree) {
+    auto current_node = tree.root;
+    // A lone symbol still takes a bit, the tree has no edge to follow.
+    if (tree.nodes[current_node].is_leaf()) {
+        read_bit();
+        return tree.nodes[current_node].data;
+    }
 
-            if (tree.root == current_node && tree.root->is_leaf())
-                --_bit_offset;
+    while (!tree.nodes[current_node].is_leaf()) {
+        const auto &node = tree.nodes[current_node];
+        current_node = read_bit() ? node.right : node.left;
+        if (current_node == huffman_node::NONE)
+            throw huffman_format_error("invalid huffman code");
+    }
+    return tree.nodes[current_node].data;
+}
 
-            return character;
-        }
+namespace {
+    uint64_t load_big_endian(const uint8_t *data) {
+        uint64_t word = 0;
+        memcpy(&word, data, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        return word;
+    }
+}
 
-        auto bit = buffer >> _bit_offset & 1u; // NOLINT(hicpp-signed-bitwise)
-        --_bit_offset;
+word_bit_reader::word_bit_reader(std::istream &stream, statistic &stat)
+    : stream(&stream), stat(stat) {
+}
 
-        if (bit == 1)
-            current_node = current_node->right;
-        else
-            current_node = current_node->left;
+word_bit_reader::word_bit_reader(const uint8_t *data, size_t size, statistic &stat)
+    : stat(stat), _data(data), _size(size) {
+    stat.input_file_size += size;
+}
 
-    }
+bool word_bit_reader::read_chunk() {
+    if (stream == nullptr)
+        return false;
+
+    _chunk.resize(CHUNK_SIZE);
+    stream->read(reinterpret_cast<char *>(_chunk.data()), CHUNK_SIZE);
+    _chunk.resize(stream->gcount());
+    _data = _chunk.data();
+    _size = _chunk.size();
+    _position = 0;
+    stat.input_file_size += _size;
+    return _size != 0;
+}
 
-    if (current_node && current_node->is_leaf()) {
-        if (current_node->count == 0)
-            return {};
-        auto character = current_node->data;
-        --current_node->count;
-        current_node = tree.root;
+void word_bit_reader::refill() {
+    while (_bits <= 56) {
+        if (_position + sizeof(uint64_t) <= _size) {
+            // Bits past the counted ones are valid data too and get OR-ed again on the next refill.
+            _buffer |= load_big_endian(_data + _position) >> _bits;
+            auto bytes = (64u - _bits) >> 3u;
+            _position += bytes;
+            _bits += bytes * 8;
+            return;
+        }
+        if (_position == _size && !read_chunk())
+            return;
 
-        return character;
+        _buffer |= uint64_t(_data[_position++]) << (56u - _bits);
+        _bits += 8;
     }
-
-    return read_huffman_char(tree);
 }
 
 bit_writer::bit_writer(std::ostream &stream, statistic &stat): stream(stream), stat(stat) {
@@ -94,7 +196,22 @@ void bit_writer::write(const std::vector<bool> &bitset) {
         ++_buffer_size;
 
         if (_buffer_size == bit_writer::MAX_BUFFER_SIZE) {
-            stream << _buffer;
+            stream.put(static_cast<char>(_buffer));
+            ++stat.output_content_size;
+
+            _buffer_size = 0;
+            _buffer = 0;
+        }
+    }
+}
+
+void bit_writer::write(const huffman_code &code) {
+    for (auto bit = code.length; bit-- > 0;) {
+        _buffer |= uint8_t((code.bits >> bit & 1u) << (7u - _buffer_size));
+        ++_buffer_size;
+
+        if (_buffer_size == bit_writer::MAX_BUFFER_SIZE) {
+            stream.put(static_cast<char>(_buffer));
             ++stat.output_content_size;
 
             _buffer_size = 0;
@@ -103,45 +220,465 @@ void bit_writer::write(const std::vector<bool> &bitset) {
     }
 }
 
+void bit_writer::write_varint(uint64_t value) {
+    do {
+        auto byte = static_cast<uint8_t>(value & 0x7fu);
+        value >>= 7u;
+        if (value != 0)
+            byte |= 0x80u;
+        stream << byte;
+        ++stat.additional_content_size;
+    } while (value != 0);
+}
+
+void append_varint(std::vector<uint8_t> &output, uint64_t value) {
+    do {
+        auto byte = static_cast<uint8_t>(value & 0x7fu);
+        value >>= 7u;
+        if (value != 0)
+            byte |= 0x80u;
+        output.push_back(byte);
+    } while (value != 0);
+}
+
+// Non-zero lengths are stored as is, runs of up to 128 unused symbols take one byte 0x80 | (run - 1).
+void append_code_lengths(std::vector<uint8_t> &output, const huffman_tree::code_lengths &lengths) {
+    for (size_t symbol = 0; symbol < lengths.size();) {
+        if (lengths[symbol] != 0) {
+            output.push_back(lengths[symbol++]);
+            continue;
+        }
+
+        size_t run = 0;
+        while (symbol < lengths.size() && lengths[symbol] == 0 && run < 128) {
+            ++symbol;
+            ++run;
+        }
+        output.push_back(static_cast<uint8_t>(0x80u | (run - 1)));
+    }
+}
+
+// Counts the bytes without writing them, a byte per used symbol and per run of unused ones.
+size_t code_lengths_header_size(const huffman_tree::code_lengths &lengths) {
+    size_t size = 0;
+    for (size_t symbol = 0; symbol < lengths.size(); ++size) {
+        if (lengths[symbol] != 0) {
+            ++symbol;
+            continue;
+        }
+
+        size_t run = 0;
+        while (symbol < lengths.size() && lengths[symbol] == 0 && run < 128) {
+            ++symbol;
+            ++run;
+        }
+    }
+    return size;
+}
+
+uint64_t coded_bits(const huffman_tree::char_counter &counter, const huffman_tree::code_lengths &lengths) {
+    uint64_t bits = 0;
+    for (size_t symbol = 0; symbol < counter.size(); ++symbol)
+        bits += uint64_t(counter[symbol]) * lengths[symbol];
+    return bits;
+}
+
+void bit_writer::write_code_lengths(const huffman_tree::code_lengths &lengths) {
+    std::vector<uint8_t> output;
+    append_code_lengths(output, lengths);
+    stream.write(reinterpret_cast<const char *>(output.data()), output.size());
+    stat.additional_content_size += output.size();
+}
+
+word_bit_writer::word_bit_writer(std::vector<uint8_t> &output): _output(output), _position(output.size()) {
+}
+
+size_t word_bit_writer::flush(std::ostream &stream) {
+    const auto size = _position;
+    stream.write(reinterpret_cast<const char *>(_output.data()), size);
+    _position = 0;
+    return size;
+}
+
+void word_bit_writer::finish() {
+    for (; _count >= 8; _count -= 8) {
+        if (_position == _output.size())
+            _output.resize(_output.size() + 1);
+        _output[_position++] = static_cast<uint8_t>(_buffer >> (_count - 8));
+    }
+    if (_count != 0) {
+        if (_position == _output.size())
+            _output.resize(_output.size() + 1);
+        _output[_position++] = static_cast<uint8_t>(_buffer << (8 - _count));
+        _count = 0;
+    }
+    _output.resize(_position);
+}
+
+void bit_writer::write_header(format_version version) {
+    stream.write(FORMAT_MAGIC.data(), FORMAT_MAGIC.size());
+    stream << static_cast<uint8_t>(version);
+    stat.additional_content_size += FORMAT_MAGIC.size() + 1;
+}
+
 void bit_writer::finish() {
     if (_buffer_size != 0) {
-        stream << _buffer;
+        stream.put(static_cast<char>(_buffer));
         ++stat.output_content_size;
     }
 }
 
-namespace {
-    huffman_tree make_tree(bit_reader &reader) {
-        auto counter = reader.read_counter();
-        return huffman_tree(prepare_counter(counter));
-    }
+memory_streambuf::memory_streambuf(const uint8_t *data, size_t size) {
+    auto *begin = const_cast<char *>(reinterpret_cast<const char *>(data));
+    setg(begin, begin, begin + size);
 }
 
-huffman_decoder::huffman_decoder(std::istream &stream): reader(bit_reader(stream, stats)), tree(make_tree(reader)) {
+memory_streambuf::pos_type memory_streambuf::seekoff(off_type offset, std::ios_base::seekdir direction,
+                                                     std::ios_base::openmode which) {
+    if (direction == std::ios_base::cur)
+        offset += gptr() - eback();
+    else if (direction == std::ios_base::end)
+        offset += egptr() - eback();
+    return seekpos(offset, which);
 }
 
+memory_streambuf::pos_type memory_streambuf::seekpos(pos_type position, std::ios_base::openmode which) {
+    if (!(which & std::ios_base::in) || position < 0 || position > egptr() - eback())
+        return pos_type(off_type(-1));
+    setg(eback(), eback() + position, egptr());
+    return position;
+}
+
+memory_istream::memory_istream(const uint8_t *data, size_t size): std::istream(nullptr), _buffer(data, size) {
+    rdbuf(&_buffer);
+}
+
+huffman_decoder::huffman_decoder(std::istream &stream, decoding_engine engine, size_t threads)
+    : reader(bit_reader(stream, stats)), engine(engine), threads(threads), stream(stream) {
+    read_header();
+}
+
+huffman_decoder::huffman_decoder(const uint8_t *data, size_t size, decoding_engine engine, size_t threads)
+    : _memory_stream(std::make_unique<memory_istream>(data, size)),
+      reader(bit_reader(*_memory_stream, stats)),
+      engine(engine),
+      threads(threads),
+      stream(*_memory_stream),
+      _data(data),
+      _size(size) {
+    read_header();
+}
+
+void huffman_decoder::read_header() {
+    std::array<char, FORMAT_MAGIC.size()> magic{};
+    if (!stream.read(magic.data(), magic.size()))
+        throw huffman_format_error("truncated header");
+
+    if (magic != FORMAT_MAGIC) {
+        uint32_t first_count = 0;
+        memcpy(&first_count, magic.data(), magic.size());
+        counter[0] = first_count;
+        auto rest = reader.read_counter(1);
+        std::copy(rest.begin() + 1, rest.end(), counter.begin() + 1);
+        stats.additional_content_size = sizeof(uint32_t) * counter.size();
+
+        tree = huffman_tree::legacy(counter);
+        codes = tree.build_code_table();
+        for (const auto value : counter)
+            symbols_count += value;
+        return;
+    }
+
+    stats.additional_content_size = magic.size();
+    format = static_cast<format_version>(reader.read_byte());
+    if (is_block_format(format)) {
+        block_size = reader.read_varint();
+        return;
+    }
+    if (format == format_version::adaptive)
+        return;
+    if (format == format_version::dictionary)
+        throw huffman_format_error("the stream needs dictionary " + std::to_string(reader.read_varint()));
+    if (format != format_version::canonical && format != format_version::interleaved &&
+        format != format_version::order1 && format != format_version::indexed && format != format_version::lz77)
+        throw huffman_format_error("unsupported format version");
+
+    symbols_count = reader.read_varint();
+    if (format == format_version::order1 || format == format_version::lz77)
+        return;
+    if (format == format_version::indexed && (block_size = reader.read_varint()) == 0)
+        throw huffman_format_error("invalid block size");
+    codes = make_canonical_codes(reader.read_code_lengths());
+    if (symbols_count != 0 &&
+        std::all_of(codes.begin(), codes.end(), [](const auto &code) { return code.length == 0; }))
+        throw huffman_format_error("no codes for the symbols");
+}
+
+// What decode(uint8_t *, size_t) keeps between calls, only the parts of the format at hand are set.
+struct huffman_decoder::bulk_state {
+    uint64_t remaining = 0;
+    // The input past the header, unless it is mapped.
+    std::vector<uint8_t> content;
+    std::optional<class decode_table> table;
+    std::optional<word_bit_reader> bits;
+    std::optional<std::array<word_bit_reader, INTERLEAVED_STREAMS>> streams;
+    std::optional<order1_decoder> order1;
+    std::optional<block_stream_decoder> blocks;
+    std::optional<adaptive_stream_decoder> adaptive;
+    std::optional<lz77_stream_decoder> lz77;
+    // Decoded but not handed out yet: the rest of a frame, or a round of the interleaved streams that
+    // did not fit.
+    const uint8_t *pending = nullptr;
+    size_t pending_size = 0;
+    std::array<uint8_t, INTERLEAVED_STREAMS> round{};
+    // Set after the last frame, the frame decoders can not read past it.
+    bool is_over = false;
+};
+
+huffman_decoder::~huffman_decoder() = default;
+
 void huffman_decoder::decode(std::ostream &output_stream) {
-    reader.current_node = tree.root;
-    while (auto character = reader.read_huffman_char(tree)) {
-        output_stream << character.value();
-        ++stats.output_content_size;
+    if (is_block_format(format)) {
+        block_options options;
+        options.block_size = block_size;
+        options.threads = threads;
+        options.is_checked = format == format_version::checked_blocks;
+        decode_blocks(stream, output_stream, stats, options);
+        return;
+    }
+    if (format == format_version::adaptive) {
+        decode_adaptive(stream, output_stream, stats);
+        return;
     }
+
+    std::vector<uint8_t> output(OUTPUT_BUFFER_SIZE);
+    while (const auto count = decode(output.data(), output.size()))
+        output_stream.write(reinterpret_cast<const char *>(output.data()), count);
+}
+
+size_t huffman_decoder::decode(uint8_t *output, size_t capacity) {
+    if (!_bulk)
+        start_bulk();
+    auto &state = *_bulk;
+    if (capacity == 0 || state.is_over)
+        return 0;
+
+    const auto take_frame = [&state](auto &decoder) {
+        state.pending_size = decoder.decode_next();
+        state.pending = decoder.output();
+        state.is_over = state.pending_size == 0;
+    };
+    if (state.pending_size == 0) {
+        if (state.blocks) {
+            take_frame(*state.blocks);
+        } else if (state.adaptive) {
+            take_frame(*state.adaptive);
+        } else if (state.lz77) {
+            take_frame(*state.lz77);
+        } else {
+            const auto count = decode_symbols(output, capacity);
+            if (state.pending_size == 0)
+                return count;
+        }
+        if (state.is_over)
+            return 0;
+    }
+
+    const auto count = std::min(capacity, state.pending_size);
+    std::memcpy(output, state.pending, count);
+    state.pending += count;
+    state.pending_size -= count;
+    return count;
+}
+
+void huffman_decoder::start_bulk() {
+    _bulk = std::make_unique<bulk_state>();
+    auto &state = *_bulk;
+    state.remaining = symbols_count;
+
+    if (is_block_format(format)) {
+        block_options options;
+        options.block_size = block_size;
+        options.is_checked = format == format_version::checked_blocks;
+        state.blocks.emplace(stream, stats, options);
+    } else if (format == format_version::adaptive) {
+        state.adaptive.emplace(stream, stats);
+    } else if (format == format_version::lz77) {
+        // Matches reach back into earlier blocks, so they are decoded from memory in order.
+        const auto [data, end] = remaining_input(state.content);
+        state.lz77.emplace(data, end, symbols_count, stats);
+    } else if (format == format_version::interleaved) {
+        // Every stream starts at its own offset, so input that is not in memory is read up front.
+        const auto [data, end] = remaining_input(state.content);
+        state.table.emplace(codes);
+        state.streams.emplace(open_interleaved(data, end, stats));
+    } else if (format == format_version::order1) {
+        auto [data, end] = remaining_input(state.content);
+        const auto *tables_start = data;
+        state.order1.emplace(read_order1_tables(data, end));
+        stats.additional_content_size += data - tables_start;
+        state.bits.emplace(data, end - data, stats);
+    } else if (engine == decoding_engine::table || format != format_version::legacy) {
+        state.table.emplace(codes);
+        const auto position = _memory_stream ? _memory_stream->position() : 0;
+        if (_memory_stream)
+            state.bits.emplace(_data + position, _size - position, stats);
+        else
+            state.bits.emplace(stream, stats);
+    }
+}
+
+size_t huffman_decoder::decode_symbols(uint8_t *output, size_t capacity) {
+    auto &state = *_bulk;
+    auto count = static_cast<size_t>(std::min<uint64_t>(state.remaining, capacity));
+
+    if (state.streams) {
+        // Every call but the last has to take whole rounds of the streams, a buffer too short for one
+        // gets it through `round`, which decode() hands out.
+        if (count != state.remaining)
+            count -= count % INTERLEAVED_STREAMS;
+        if (count == 0) {
+            const auto round_size = static_cast<size_t>(std::min<uint64_t>(state.remaining, INTERLEAVED_STREAMS));
+            state.table->decode(*state.streams, state.round.data(), round_size);
+            state.remaining -= round_size;
+            stats.output_content_size += round_size;
+            state.pending = state.round.data();
+            state.pending_size = round_size;
+            return 0;
+        }
+        state.table->decode(*state.streams, output, count);
+    } else if (state.order1) {
+        state.order1->decode(*state.bits, output, count);
+    } else if (state.table) {
+        state.table->decode(*state.bits, output, count);
+    } else {
+        for (size_t offset = 0; offset < count; ++offset)
+            output[offset] = reader.read_huffman_char(tree);
+    }
+
+    state.remaining -= count;
+    stats.output_content_size += count;
+    return count;
+}
+
+// The index locates the block of `start`, the symbols before it in that block are decoded and dropped.
+void huffman_decoder::decode_range(uint64_t start, uint64_t length, std::ostream &output_stream) {
+    if (format != format_version::indexed)
+        throw std::invalid_argument("only streams with a block index support ranges");
+
+    std::vector<uint8_t> content;
+    const auto [data, end] = remaining_input(content);
+    const auto blocks = (symbols_count + block_size - 1) / block_size;
+    if (blocks > uint64_t(end - data) / sizeof(uint64_t))
+        throw huffman_format_error("truncated block index");
+    const auto *index = end - blocks * sizeof(uint64_t);
+    stats.additional_content_size += end - index;
+    if (start >= symbols_count)
+        return;
+
+    const auto block = start / block_size;
+    uint64_t offset = 0;
+    for (size_t byte = 0; byte < sizeof(offset); ++byte)
+        offset |= uint64_t(index[block * sizeof(offset) + byte]) << (8 * byte);
+    if (offset / 8 > uint64_t(index - data))
+        throw huffman_format_error("invalid block index");
+
+    const class decode_table table(codes);
+    word_bit_reader bits(data + offset / 8, index - data - offset / 8, stats);
+    bits.refill();
+    bits.consume(offset % 8);
+
+    std::vector<uint8_t> output(OUTPUT_BUFFER_SIZE);
+    for (uint64_t skipped = start - block * block_size; skipped > 0;) {
+        const auto count = static_cast<size_t>(std::min<uint64_t>(skipped, output.size()));
+        table.decode(bits, output.data(), count);
+        skipped -= count;
+    }
+
+    length = std::min(length, symbols_count - start);
+    for (uint64_t remaining = length; remaining > 0;) {
+        const auto count = static_cast<size_t>(std::min<uint64_t>(remaining, output.size()));
+        table.decode(bits, output.data(), count);
+        output_stream.write(reinterpret_cast<const char *>(output.data()), count);
+        remaining -= count;
+    }
+    stats.output_content_size += length;
+}
+
+std::pair<const uint8_t *, const uint8_t *> huffman_decoder::remaining_input(std::vector<uint8_t> &content) {
+    if (_memory_stream)
+        return {_data + _memory_stream->position(), _data + _size};
+
+    content.assign(std::istreambuf_iterator<char>(stream), {});
+    return {content.data(), content.data() + content.size()};
+}
+
+static_assert(std::is_same_v<byte_histogram, huffman_tree::char_counter>);
+
+huffman_tree::char_counter count_characters(const uint8_t *data, size_t size) {
+    huffman_tree::char_counter counter{};
+    accumulate_histogram(data, size, counter);
+    return counter;
 }
 
 namespace {
+    template<typename F>
+    void for_each_chunk(std::istream &stream, F &&function) {
+        std::vector<uint8_t> chunk(huffman_encoder::INPUT_BUFFER_SIZE);
+        while (stream.read(reinterpret_cast<char *>(chunk.data()), chunk.size()) || stream.gcount() != 0)
+            function(chunk.data(), static_cast<size_t>(stream.gcount()));
+    }
+
     huffman_tree::char_counter count_characters(std::istream &stream, statistic &stats) {
         huffman_tree::char_counter counter{};
-        uint8_t character = '\0';
-        while (stream >> character) {
-            ++stats.input_file_size;
-            ++counter[character];
-        }
+        for_each_chunk(stream, [&](const uint8_t *data, size_t size) {
+            accumulate_histogram(data, size, counter);
+            stats.input_file_size += size;
+        });
         return counter;
     }
+
+    huffman_tree make_tree(const huffman_tree::char_counter &counter, format_version format) {
+        return format == format_version::legacy ? huffman_tree::legacy(counter) : huffman_tree(prepare_counter(counter));
+    }
+}
+
+huffman_encoder::huffman_encoder(std::istream &stream, format_version format, uint8_t max_code_length)
+    : format(format) {
+    {
+        phase_timer timer(metrics, encoder_metrics::histogram);
+        counter = count_characters(stream, stats);
+    }
+    build_tree(max_code_length);
+}
+
+huffman_encoder::huffman_encoder(const uint8_t *data, size_t size, format_version format, uint8_t max_code_length)
+    : format(format) {
+    stats.input_file_size = size;
+    {
+        phase_timer timer(metrics, encoder_metrics::histogram);
+        counter = count_characters(data, size);
+    }
+    build_tree(max_code_length);
 }
 
-huffman_encoder::huffman_encoder(std::istream &stream)
-    : counter(count_characters(stream, stats)), tree(prepare_counter(counter)) {
+void huffman_encoder::build_tree(uint8_t max_code_length) {
+    if (format == format_version::legacy && max_code_length != huffman_tree::MAX_CODE_LENGTH)
+        throw std::invalid_argument("the legacy layout can not limit code lengths");
+    if (format == format_version::legacy && *std::max_element(counter.begin(), counter.end()) > UINT32_MAX)
+        throw std::invalid_argument("the legacy layout stores 32-bit counts, no byte may occur 4 GiB times");
+
+    {
+        phase_timer timer(metrics, encoder_metrics::tree);
+        tree = make_tree(counter, format);
+        lengths = format == format_version::legacy ? tree.build_code_lengths()
+                                                   : build_code_lengths(counter, max_code_length);
+    }
+    metrics.input_bytes = 0;
+    for (const auto value : counter)
+        metrics.input_bytes += value;
+    metrics.entropy = shannon_entropy(counter);
+    metrics.average_code_length = average_code_length(counter, lengths);
 }
 
 std::string to_string(std::vector<bool> const &bitvector) {
@@ -152,125 +689,255 @@ std::string to_string(std::vector<bool> const &bitvector) {
     }
     return ret;
 }
-void huffman_encoder::encode(std::istream &input_stream, std::ostream &output_stream) {
-    bit_writer writer(output_stream, stats);
 
-    for (const auto value: counter) {
-        writer.write(value);
+std::string to_string(const huffman_code &code) {
+    std::string ret;
+    ret.reserve(code.length);
+    for (auto bit = code.length; bit-- > 0;) {
+        ret.push_back(code.bits >> bit & 1u ? '1' : '0');
     }
+    return ret;
+}
 
-    const auto table = tree.build_table();
+huffman_tree::code_table huffman_encoder::build_codes() const {
+    if (format == format_version::legacy)
+        return tree.build_code_table();
+    return make_canonical_codes(lengths);
+}
 
-    uint8_t character = '\0';
-    while (input_stream >> character) {
-        auto bitset = table[character];
-        writer.write(bitset);
+void huffman_encoder::write_header(bit_writer &writer) {
+    if (format == format_version::legacy) {
+        for (const auto value: counter) {
+            writer.write(static_cast<uint32_t>(value));
+        }
+        stats.additional_content_size = sizeof(uint32_t) * counter.size();
+    } else {
+        uint64_t symbols_count = 0;
+        for (const auto value: counter) {
+            symbols_count += value;
+        }
+
+        writer.write_header(format);
+        writer.write_varint(symbols_count);
+        if (format == format_version::indexed)
+            writer.write_varint(index_block_size);
+        writer.write_code_lengths(lengths);
     }
+}
 
+void huffman_encoder::encode(std::istream &input_stream, std::ostream &output_stream) {
+    if (format == format_version::interleaved || format == format_version::indexed) {
+        const std::vector<uint8_t> content(std::istreambuf_iterator<char>(input_stream), {});
+        encode(content.data(), content.size(), output_stream);
+        return;
+    }
+
+    const auto table = start_encoding(output_stream);
+    std::vector<uint8_t> output;
+    word_bit_writer writer(output);
+
+    for_each_chunk(input_stream, [&](const uint8_t *data, size_t size) {
+        {
+            phase_timer timer(metrics, encoder_metrics::encode);
+            for (const auto *end = data + size; data != end; ++data)
+                writer.write(table[*data]);
+        }
+        phase_timer timer(metrics, encoder_metrics::flush);
+        stats.output_content_size += writer.flush(output_stream);
+    });
+
+    phase_timer timer(metrics, encoder_metrics::flush);
     writer.finish();
+    stats.output_content_size += writer.flush(output_stream);
+}
 
+// Writes the header and builds the codes, the work every layout does before its first symbol.
+huffman_tree::code_table huffman_encoder::start_encoding(std::ostream &output_stream) {
+    {
+        phase_timer timer(metrics, encoder_metrics::flush);
+        bit_writer header_writer(output_stream, stats);
+        write_header(header_writer);
+    }
+    phase_timer timer(metrics, encoder_metrics::table);
+    return build_codes();
 }
 
-huffman_node::huffman_node(char data, uint32_t count): data(data), count(count) {}
+void huffman_encoder::encode(const uint8_t *data, size_t size, std::ostream &output_stream) {
+    if (format == format_version::indexed && index_block_size == 0)
+        throw std::invalid_argument("index block size must be positive");
+    const auto table = start_encoding(output_stream);
+
+    if (format == format_version::interleaved) {
+        std::vector<uint8_t> output;
+        {
+            phase_timer timer(metrics, encoder_metrics::encode);
+            append_interleaved(output, data, size, table);
+        }
+        phase_timer timer(metrics, encoder_metrics::flush);
+        output_stream.write(reinterpret_cast<const char *>(output.data()), output.size());
+        stats.output_content_size += output.size();
+        return;
+    }
+
+    std::vector<uint8_t> output;
+    word_bit_writer writer(output);
+    std::vector<uint64_t> index;
+    uint64_t flushed_bits = 0;
+
+    for (const auto *start = data, *end = data + size; data != end;) {
+        auto chunk_size = std::min<size_t>(end - data, INPUT_BUFFER_SIZE);
+        if (format == format_version::indexed) {
+            const auto block_offset = static_cast<uint64_t>(data - start) % index_block_size;
+            if (block_offset == 0)
+                index.push_back(flushed_bits + writer.pending_bits());
+            chunk_size = static_cast<size_t>(std::min<uint64_t>(chunk_size, index_block_size - block_offset));
+        }
+
+        {
+            phase_timer timer(metrics, encoder_metrics::encode);
+            for (const auto *chunk_end = data + chunk_size; data != chunk_end; ++data)
+                writer.write(table[*data]);
+        }
+        phase_timer timer(metrics, encoder_metrics::flush);
+        const auto flushed = writer.flush(output_stream);
+        flushed_bits += flushed * 8;
+        stats.output_content_size += flushed;
+    }
 
-huffman_node::huffman_node(huffman_node *left_child, huffman_node *right_child, uint32_t count)
-    : data('\0'), count(count), left(left_child), right(right_child) {
+    phase_timer timer(metrics, encoder_metrics::flush);
+    writer.finish();
+    stats.output_content_size += writer.flush(output_stream);
+    write_index(index, output_stream);
+}
+
+// Every entry is a little-endian uint64_t, the count follows from the header.
+void huffman_encoder::write_index(const std::vector<uint64_t> &index, std::ostream &output_stream) {
+    for (const auto offset : index) {
+        std::array<uint8_t, sizeof(offset)> bytes{};
+        for (size_t byte = 0; byte < bytes.size(); ++byte)
+            bytes[byte] = static_cast<uint8_t>(offset >> (8 * byte));
+        output_stream.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+    }
+    stats.additional_content_size += index.size() * sizeof(uint64_t);
 }
 
 bool huffman_node::is_leaf() const noexcept {
-    return left == nullptr && right == nullptr;
+    return left == NONE;
 }
 
-uint32_t huffman_node::weight() const noexcept {
+uint64_t huffman_node::weight() const noexcept {
     return count;
 }
 
-huffman_node::~huffman_node() {
-    delete left;
-    delete right;
-}
 std::ostream &operator<<(std::ostream &os, const huffman_node &node) {
     os << "[" << node.data << "](" << node.count << ")";
     return os;
 }
 
-namespace {
-    typedef bool (*comparator_t)(huffman_node *, huffman_node *);
-
-    bool comparator(huffman_node *lhs, huffman_node *rhs) {
-        auto lhs_weight = lhs->weight();
-        auto rhs_weight = rhs->weight();
-
-        return lhs_weight > rhs_weight || (lhs_weight == rhs_weight && lhs->data > rhs->data);
-    }
-
-    huffman_node *merge(huffman_node *lhs, huffman_node *rhs) {
-        auto node = new huffman_node('\0', lhs->count + rhs->count);
-
-        node->left = lhs;
-        node->right = rhs;
+// Both queues stay sorted: the leaves come sorted and merged weights never decrease, so the two
+// lightest nodes are always at their fronts.
+huffman_tree::huffman_tree(const sorted_counter &counter) {
+    const uint16_t leaves = counter.size;
+    for (uint16_t index = 0; index < leaves; ++index)
+        nodes[index] = {counter.symbols[index].second, huffman_node::NONE, huffman_node::NONE,
+                        counter.symbols[index].first};
+    if (leaves == 0)
+        return;
 
-        return node;
+    uint16_t leaf = 0;
+    uint16_t internal = leaves;
+    uint16_t size = leaves;
+    const auto take_lightest = [&] {
+        if (leaf < leaves && (internal == size || nodes[leaf].count <= nodes[internal].count))
+            return leaf++;
+        return internal++;
+    };
+
+    while (size < 2 * leaves - 1) {
+        const auto left = take_lightest();
+        const auto right = take_lightest();
+        nodes[size++] = {nodes[left].count + nodes[right].count, left, right, 0};
     }
+    root = size - 1;
 }
 
-huffman_tree::huffman_tree(const std::vector<std::pair<char, uint32_t>> &char_counters) {
-    std::priority_queue<huffman_node *, std::vector<huffman_node *>, comparator_t> queue(comparator);
-
-    for (const auto &element: char_counters) {
-        auto node = new huffman_node(element.first, element.second);
-        queue.push(node);
+huffman_tree huffman_tree::legacy(const char_counter &counter) {
+    huffman_tree tree;
+    uint16_t size = 0;
+    for (uint32_t character = 0; character < counter.size(); ++character) {
+        if (counter[character] != 0)
+            tree.nodes[size++] = {counter[character], huffman_node::NONE, huffman_node::NONE,
+                                  static_cast<uint8_t>(character)};
     }
-    if (queue.empty())
-        return;
-
-    while (queue.size() > 1) {
-        auto first = queue.top();
-        queue.pop();
-        auto second = queue.top();
-        queue.pop();
+    if (size == 0)
+        return tree;
 
-        auto node = merge(first, second);
+    // The heap sees the leaves in the order and through the comparator the pointer-based tree used,
+    // ties between equal weights resolve the same way.
+    std::sort(tree.nodes.begin(), tree.nodes.begin() + size, [](const auto &lhs, const auto &rhs) {
+        return lhs.count < rhs.count || (lhs.count == rhs.count && char(lhs.data) > char(rhs.data));
+    });
+    const auto comparator = [&nodes = tree.nodes](uint16_t lhs, uint16_t rhs) {
+        return nodes[lhs].count > nodes[rhs].count ||
+               (nodes[lhs].count == nodes[rhs].count && nodes[lhs].data > nodes[rhs].data);
+    };
+
+    std::array<uint16_t, CHARACTERS_COUNT> heap{};
+    uint16_t heap_size = 0;
+    for (uint16_t index = 0; index < size; ++index) {
+        heap[heap_size++] = index;
+        std::push_heap(heap.begin(), heap.begin() + heap_size, comparator);
+    }
 
-        queue.push(node);
+    const auto pop = [&] {
+        std::pop_heap(heap.begin(), heap.begin() + heap_size, comparator);
+        return heap[--heap_size];
+    };
+    while (heap_size > 1) {
+        const auto left = pop();
+        const auto right = pop();
+        tree.nodes[size] = {tree.nodes[left].count + tree.nodes[right].count, left, right, 0};
+        heap[heap_size++] = size++;
+        std::push_heap(heap.begin(), heap.begin() + heap_size, comparator);
     }
 
-    root = queue.top();
+    tree.root = heap[0];
+    return tree;
 }
 
-huffman_tree::~huffman_tree() {
-    delete root;
+bool huffman_tree::empty() const noexcept {
+    return root == huffman_node::NONE;
 }
 
 namespace {
     constexpr uint8_t COUNT = 10;
-    void __print_helper(std::ostream &os, huffman_node *node, int space) {
-        if (node == nullptr)
+    void __print_helper(std::ostream &os, const huffman_tree &tree, uint16_t index, int space) {
+        if (index == huffman_node::NONE)
             return;
 
+        const auto &node = tree.nodes[index];
         space += COUNT;
 
-        __print_helper(os, node->right, space);
+        __print_helper(os, tree, node.right, space);
 
         os << std::endl;
         for (int i = COUNT; i < space; i++)
             os << " ";
-        os << *node << "\n";
+        os << node << "\n";
 
-        __print_helper(os, node->left, space);
+        __print_helper(os, tree, node.left, space);
     }
 
-    void print(std::ostream &os, huffman_node *root) {
-        __print_helper(os, root, 0);
+    void print(std::ostream &os, const huffman_tree &tree) {
+        __print_helper(os, tree, tree.root, 0);
     }
 
-    void make_huffman_table(std::vector<bool> &&bitset, huffman_tree::table &table, huffman_node *node = nullptr) {
-        if (!node)
-            return;
-
-        if (node->is_leaf()) {
+    void make_huffman_table(std::vector<bool> &&bitset, huffman_tree::table &table, const huffman_tree &tree,
+                            uint16_t index) {
+        const auto &node = tree.nodes[index];
+        if (node.is_leaf()) {
             std::reverse(bitset.begin(), bitset.end());
-            table[node->data] = bitset;
+            table[node.data] = bitset;
             return;
         }
 
@@ -279,39 +946,410 @@ namespace {
         auto right_bitset = bitset;
         right_bitset.push_back(true);
 
-        make_huffman_table(std::move(left_bitset), table, node->left);
-        make_huffman_table(std::move(right_bitset), table, node->right);
+        make_huffman_table(std::move(left_bitset), table, tree, node.left);
+        make_huffman_table(std::move(right_bitset), table, tree, node.right);
+    }
+}
+
+namespace {
+    void make_code_table(huffman_code code, huffman_tree::code_table &table, const huffman_tree &tree,
+                         uint16_t index) {
+        const auto &node = tree.nodes[index];
+        if (node.is_leaf()) {
+            table[node.data] = code;
+            return;
+        }
+
+        const auto length = static_cast<uint8_t>(code.length + 1);
+        make_code_table({code.bits << 1u, length}, table, tree, node.left);
+        make_code_table({code.bits << 1u | 1u, length}, table, tree, node.right);
+    }
+
+    uint64_t low_bits(uint64_t value, uint8_t count) {
+        return count >= 64 ? value : value & ((uint64_t(1) << count) - 1);
+    }
+}
+
+decode_table::decode_table(const huffman_tree::code_table &codes) {
+    std::vector<symbol_code> symbols;
+    for (uint32_t symbol = 0; symbol < codes.size(); ++symbol) {
+        if (codes[symbol].length != 0)
+            symbols.push_back({codes[symbol].bits, codes[symbol].length, static_cast<uint8_t>(symbol)});
+    }
+    if (symbols.empty())
+        return;
+
+    _entries.resize(size_t(1) << PRIMARY_BITS);
+    fill(0, PRIMARY_BITS, 0, symbols);
+    combine_primary();
+}
+
+void decode_table::fill(size_t offset, uint8_t table_bits, uint8_t consumed, const std::vector<symbol_code> &codes) {
+    std::map<uint64_t, std::vector<symbol_code>> longer;
+
+    for (const auto &code : codes) {
+        const auto length = static_cast<uint8_t>(code.length - consumed);
+        const auto bits = low_bits(code.bits, length);
+
+        if (length > table_bits) {
+            longer[bits >> (length - table_bits)].push_back(code);
+            continue;
+        }
+
+        const auto first = bits << (table_bits - length);
+        const auto last = first + (uint64_t(1) << (table_bits - length));
+        for (auto index = first; index < last; ++index) {
+            auto &entry = _entries[offset + index];
+            entry.symbols[0] = code.symbol;
+            entry.lengths[0] = length;
+            entry.count = 1;
+        }
+    }
+
+    for (const auto &[index, group] : longer) {
+        uint8_t max_length = 0;
+        for (const auto &code : group)
+            max_length = std::max<uint8_t>(max_length, code.length - consumed - table_bits);
+
+        const auto sub_bits = std::min(max_length, PRIMARY_BITS);
+        const auto link = _entries.size();
+        _entries.resize(link + (size_t(1) << sub_bits));
+
+        auto &entry = _entries[offset + index];
+        entry.link = static_cast<uint32_t>(link);
+        entry.lengths[0] = table_bits;
+        entry.sub_bits = sub_bits;
+
+        fill(link, sub_bits, consumed + table_bits, group);
+    }
+}
+
+void decode_table::combine_primary() {
+    const uint32_t size = 1u << PRIMARY_BITS;
+    const std::vector<entry> single(_entries.begin(), _entries.begin() + size);
+
+    for (uint32_t index = 0; index < size; ++index) {
+        auto &entry = _entries[index];
+        if (entry.count != 1)
+            continue;
+
+        for (auto length = entry.lengths[0]; entry.count < MAX_SYMBOLS_PER_ENTRY && length < PRIMARY_BITS;) {
+            const auto &next = single[(index << length) & (size - 1)];
+            if (next.count != 1 || next.lengths[0] > PRIMARY_BITS - length)
+                break;
+
+            length += next.lengths[0];
+            entry.symbols[entry.count] = next.symbols[0];
+            entry.lengths[entry.count] = length;
+            ++entry.count;
+        }
+    }
+}
+
+const decode_table::entry &decode_table::lookup(word_bit_reader &bits) const {
+    if (_entries.empty())
+        throw huffman_format_error("empty huffman table");
+    if (bits.available() < PRIMARY_BITS)
+        bits.refill();
+    if (bits.available() == 0)
+        throw huffman_format_error("unexpected end of huffman stream");
+
+    const auto *entry = &_entries[bits.peek(PRIMARY_BITS)];
+    while (entry->is_link()) {
+        bits.consume(entry->lengths[0]);
+        if (bits.available() < entry->sub_bits)
+            bits.refill();
+        entry = &_entries[entry->link + bits.peek(entry->sub_bits)];
+    }
+    if (entry->count == 0)
+        throw huffman_format_error("invalid huffman code");
+    return *entry;
+}
+
+template<size_t STRIDE>
+void decode_table::decode_strided(word_bit_reader &bits, uint8_t *output, size_t count) const {
+    for (const auto *end = output + count * STRIDE; output != end;) {
+        const auto &entry = lookup(bits);
+        const auto taken = std::min<size_t>(entry.count, (end - output) / STRIDE);
+        for (size_t offset = 0; offset < taken; ++offset, output += STRIDE)
+            *output = entry.symbols[offset];
+        bits.consume(entry.lengths[taken - 1]);
     }
 }
 
+void decode_table::decode(word_bit_reader &bits, uint8_t *output, size_t count) const {
+    decode_strided<1>(bits, output, count);
+}
+
+void decode_table::decode(std::array<word_bit_reader, INTERLEAVED_STREAMS> &bits, uint8_t *output,
+                          size_t count) const {
+    constexpr auto STRIDE = INTERLEAVED_STREAMS;
+    std::array<uint8_t *, STRIDE> outputs{};
+    std::array<size_t, STRIDE> remaining{};
+    for (size_t stream = 0; stream < STRIDE; ++stream) {
+        outputs[stream] = output + stream;
+        remaining[stream] = count > stream ? (count - stream + STRIDE - 1) / STRIDE : 0;
+    }
+
+    // While every stream has room for a whole entry all of its symbols are stored unconditionally.
+    const auto has_room = [&] {
+        return std::all_of(remaining.begin(), remaining.end(), [](size_t left) {
+            return left >= MAX_SYMBOLS_PER_ENTRY;
+        });
+    };
+    while (!_entries.empty() && has_room()) {
+        for (size_t stream = 0; stream < STRIDE; ++stream) {
+            auto &stream_bits = bits[stream];
+            if (stream_bits.available() < PRIMARY_BITS)
+                stream_bits.refill();
+            const auto *entry = &_entries[stream_bits.peek(PRIMARY_BITS)];
+            if (entry->count == 0 || stream_bits.available() == 0)
+                entry = &lookup(stream_bits);
+            for (size_t offset = 0; offset < MAX_SYMBOLS_PER_ENTRY; ++offset)
+                outputs[stream][offset * STRIDE] = entry->symbols[offset];
+            outputs[stream] += entry->count * STRIDE;
+            remaining[stream] -= entry->count;
+            stream_bits.consume(entry->lengths[entry->count - 1]);
+        }
+    }
+
+    for (size_t stream = 0; stream < STRIDE; ++stream)
+        decode_strided<STRIDE>(bits[stream], outputs[stream], remaining[stream]);
+}
+
+// Both directions spell the streams out.
+static_assert(INTERLEAVED_STREAMS == 4);
+
+void append_interleaved(std::vector<uint8_t> &output, const uint8_t *data, size_t size,
+                        const huffman_tree::code_table &codes) {
+    std::array<std::vector<uint8_t>, INTERLEAVED_STREAMS> streams;
+    std::array<word_bit_writer, INTERLEAVED_STREAMS> writers{
+        word_bit_writer(streams[0]), word_bit_writer(streams[1]),
+        word_bit_writer(streams[2]), word_bit_writer(streams[3])};
+
+    const auto *end = data + size;
+    for (; end - data >= static_cast<ptrdiff_t>(INTERLEAVED_STREAMS); data += INTERLEAVED_STREAMS) {
+        writers[0].write(codes[data[0]]);
+        writers[1].write(codes[data[1]]);
+        writers[2].write(codes[data[2]]);
+        writers[3].write(codes[data[3]]);
+    }
+    for (size_t stream = 0; data != end; ++data, ++stream)
+        writers[stream].write(codes[*data]);
+
+    for (auto &writer : writers)
+        writer.finish();
+    for (size_t stream = 0; stream + 1 < INTERLEAVED_STREAMS; ++stream)
+        append_varint(output, streams[stream].size());
+    for (const auto &stream : streams)
+        output.insert(output.end(), stream.begin(), stream.end());
+}
+
+std::array<word_bit_reader, INTERLEAVED_STREAMS> open_interleaved(const uint8_t *data, const uint8_t *end,
+                                                                  statistic &stats) {
+    const auto *start = data;
+    std::array<size_t, INTERLEAVED_STREAMS> sizes{};
+    for (size_t stream = 0; stream + 1 < INTERLEAVED_STREAMS; ++stream)
+        sizes[stream] = read_varint(data, end);
+    stats.additional_content_size += data - start;
+
+    std::array<const uint8_t *, INTERLEAVED_STREAMS> streams{};
+    for (size_t stream = 0; stream < INTERLEAVED_STREAMS; ++stream) {
+        if (stream + 1 == INTERLEAVED_STREAMS)
+            sizes[stream] = end - data;
+        else if (sizes[stream] > static_cast<size_t>(end - data))
+            throw huffman_format_error("invalid stream offsets");
+        streams[stream] = data;
+        data += sizes[stream];
+    }
+
+    return {word_bit_reader(streams[0], sizes[0], stats), word_bit_reader(streams[1], sizes[1], stats),
+            word_bit_reader(streams[2], sizes[2], stats), word_bit_reader(streams[3], sizes[3], stats)};
+}
+
 std::ostream &operator<<(std::ostream &os, const huffman_tree &tree) {
-    print(os, tree.root);
+    print(os, tree);
     return os;
 }
 
 huffman_tree::table huffman_tree::build_table() const {
     table huffman_table;
 
-    if (root == nullptr)
+    if (empty())
         return huffman_table;
-    if (root->is_leaf()) {
-        huffman_table[root->data] = {false};
+    if (nodes[root].is_leaf()) {
+        huffman_table[nodes[root].data] = {false};
     } else
-        make_huffman_table(std::vector<bool>(), huffman_table, root);
+        make_huffman_table(std::vector<bool>(), huffman_table, *this, root);
 
     return huffman_table;
 }
 
-std::vector<std::pair<char, uint32_t>> prepare_counter(const huffman_tree::char_counter &counter) {
-    std::vector<std::pair<char, uint32_t>> result;
-    for (uint64_t character = 0; character < counter.size(); ++character) {
+huffman_tree::code_table huffman_tree::build_code_table() const {
+    code_table codes;
+
+    if (empty())
+        return codes;
+    if (nodes[root].is_leaf())
+        codes[nodes[root].data] = {0, 1};
+    else
+        make_code_table({}, codes, *this, root);
+
+    return codes;
+}
+
+huffman_tree::code_lengths huffman_tree::build_code_lengths() const {
+    code_lengths lengths{};
+    const auto codes = build_code_table();
+    for (size_t symbol = 0; symbol < codes.size(); ++symbol)
+        lengths[symbol] = codes[symbol].length;
+    return lengths;
+}
+
+namespace {
+    using length_counts = std::array<uint32_t, huffman_tree::MAX_CODE_LENGTH + 1>;
+
+    // Symbols of every length, unused ones are not counted.
+    length_counts count_lengths(const huffman_tree::code_lengths &lengths) {
+        length_counts length_count{};
+        for (const auto length : lengths)
+            ++length_count[length];
+        length_count[0] = 0;
+        return length_count;
+    }
+
+    // Kraft's inequality, checked as the codes left free on every length: each free code of a length is
+    // two of the next one. Past the number of symbols still to place they can not run out, so the count
+    // is capped there and never overflows, not even on the 64th length. Zero for a complete code.
+    uint64_t free_codes(const length_counts &length_count) {
+        uint64_t symbols_left = 0;
+        for (const auto count : length_count)
+            symbols_left += count;
+
+        uint64_t free = 1;
+        for (uint8_t length = 1; length <= huffman_tree::MAX_CODE_LENGTH; ++length) {
+            free = std::min(2 * free, symbols_left + 1);
+            if (length_count[length] > free)
+                throw huffman_format_error("oversubscribed code lengths");
+            free -= length_count[length];
+            symbols_left -= length_count[length];
+        }
+        return free;
+    }
+}
+
+bool is_complete_code(const huffman_tree::code_lengths &lengths) {
+    const auto length_count = count_lengths(lengths);
+    // The only symbol of a block gets a code of length 1, the other half of the code space stays unused.
+    const auto symbols = std::count_if(lengths.begin(), lengths.end(), [](uint8_t length) { return length != 0; });
+    return free_codes(length_count) == 0 || (symbols == 1 && length_count[1] == 1);
+}
+
+huffman_tree::code_table make_canonical_codes(const huffman_tree::code_lengths &lengths) {
+    const auto length_count = count_lengths(lengths);
+    free_codes(length_count);
+
+    // Every code so far fits into `length - 1` bits, so the shift loses a bit only when the lengths
+    // above used up all codes, and then free_codes() has made sure no symbol is left for this length.
+    std::array<uint64_t, huffman_tree::MAX_CODE_LENGTH + 1> next_code{};
+    uint64_t code = 0;
+    for (uint8_t length = 1; length <= huffman_tree::MAX_CODE_LENGTH; ++length) {
+        code = (code + length_count[length - 1]) << 1u;
+        next_code[length] = code;
+    }
+
+    huffman_tree::code_table codes;
+    for (size_t symbol = 0; symbol < lengths.size(); ++symbol) {
+        const auto length = lengths[symbol];
+        if (length != 0)
+            codes[symbol] = {next_code[length]++, length};
+    }
+    return codes;
+}
+
+// Level by level from the longest length, the list holds the leaves merged with pairs of the level
+// below. The first 2n - 2 items of the last level are taken, and every level selects as many of its
+// items as the packages taken from the level above stand for. A symbol's length is the number of
+// levels its leaf is selected on, the selected leaves are always the lightest ones of the level.
+huffman_tree::code_lengths limited_code_lengths(const huffman_tree::sorted_counter &counter, uint8_t max_length) {
+    const size_t leaves = counter.size;
+    if (max_length == 0 || max_length > huffman_tree::MAX_CODE_LENGTH ||
+        (max_length < 64 && leaves > uint64_t(1) << max_length))
+        throw std::invalid_argument("code length limit is too small for the alphabet");
+
+    huffman_tree::code_lengths lengths{};
+    if (leaves == 1)
+        lengths[counter.symbols[0].first] = 1;
+    if (leaves < 2)
+        return lengths;
+
+    const size_t list_size = 2 * leaves - 2;
+    std::vector<uint8_t> is_package(max_length * list_size);
+    std::vector<uint64_t> weights;
+    std::vector<uint64_t> merged;
+
+    for (size_t level = max_length; level-- > 0;) {
+        merged.clear();
+        auto *packages = &is_package[level * list_size];
+        size_t leaf = 0;
+        size_t pair = 0;
+        while (merged.size() < list_size && (leaf < leaves || pair + 1 < weights.size())) {
+            const bool has_pair = pair + 1 < weights.size();
+            if (leaf < leaves && (!has_pair || counter.symbols[leaf].second <= weights[pair] + weights[pair + 1])) {
+                packages[merged.size()] = 0;
+                merged.push_back(counter.symbols[leaf++].second);
+            } else {
+                packages[merged.size()] = 1;
+                merged.push_back(weights[pair] + weights[pair + 1]);
+                pair += 2;
+            }
+        }
+        std::swap(weights, merged);
+    }
+
+    for (size_t level = 0, selected = list_size; level < max_length && selected != 0; ++level) {
+        const auto *packages = &is_package[level * list_size];
+        size_t package_count = 0;
+        for (size_t item = 0; item < selected; ++item)
+            package_count += packages[item];
+        for (size_t leaf = 0; leaf < selected - package_count; ++leaf)
+            ++lengths[counter.symbols[leaf].first];
+        selected = 2 * package_count;
+    }
+    return lengths;
+}
+
+bool is_valid_code_length_limit(uint8_t max_length) noexcept {
+    return max_length >= huffman_tree::MIN_CODE_LENGTH_LIMIT && max_length <= huffman_tree::MAX_CODE_LENGTH;
+}
+
+void validate_code_length_limit(uint8_t max_length) {
+    if (!is_valid_code_length_limit(max_length))
+        throw std::invalid_argument("code length limit must be within [" +
+                                    std::to_string(huffman_tree::MIN_CODE_LENGTH_LIMIT) + ", " +
+                                    std::to_string(huffman_tree::MAX_CODE_LENGTH) + "]");
+}
+
+huffman_tree::code_lengths build_code_lengths(const huffman_tree::char_counter &counter, uint8_t max_length) {
+    validate_code_length_limit(max_length);
+
+    const auto sorted = prepare_counter(counter);
+    auto lengths = huffman_tree(sorted).build_code_lengths();
+    if (*std::max_element(lengths.begin(), lengths.end()) > max_length)
+        lengths = limited_code_lengths(sorted, max_length);
+    return lengths;
+}
+
+huffman_tree::sorted_counter prepare_counter(const huffman_tree::char_counter &counter) {
+    huffman_tree::sorted_counter result;
+    for (uint32_t character = 0; character < counter.size(); ++character) {
         if (counter[character] == 0)
             continue;
-        result.emplace_back(character, counter[character]);
+        result.symbols[result.size++] = {static_cast<uint8_t>(character), counter[character]};
     }
 
-    std::stable_sort(result.begin(), result.end(), [](auto lhs, auto rhs) {
-        return lhs.second < rhs.second || (lhs.second == rhs.second && lhs.first > rhs.first);
+    std::sort(result.symbols.begin(), result.symbols.begin() + result.size, [](auto lhs, auto rhs) {
+        return lhs.second < rhs.second || (lhs.second == rhs.second && lhs.first < rhs.first);
     });
     return result;
 }
@@ -323,7 +1361,10 @@ char_cli_argument::char_cli_argument(char character, uint32_t arguments_number,
 std::optional<cli_option> char_cli_argument::get_option(const program_arguments &arguments) const {
     auto tokens = arguments.tokens();
     std::string argument{cli_argument::argument_prefix, character};
-    auto argument_it = std::find(tokens.begin(), tokens.end(), argument) + 1;
+    auto argument_it = std::find(tokens.begin(), tokens.end(), argument);
+    if (argument_it == tokens.end())
+        return {};
+    ++argument_it;
     auto argument_end_iterator = argument_it + arguments_number;
 
     if (std::distance(argument_end_iterator, tokens.end()) >= 0) {
@@ -384,6 +1425,22 @@ void program_arguments::print_usage(std::ostream &os) {
     _usage(_program_name, os);
 }
 
+uint64_t parse_number(const std::string &value, const std::string &name, uint64_t max) {
+    uint64_t number = 0;
+    const auto *end = value.data() + value.size();
+    const auto [position, error] = std::from_chars(value.data(), end, number);
+    if (error != std::errc() || position != end || number > max)
+        throw std::invalid_argument(name + " needs a number up to " + std::to_string(max) + ", not " + value);
+    return number;
+}
+
+statistic &statistic::operator+=(const statistic &other) {
+    input_file_size += other.input_file_size;
+    output_content_size += other.output_content_size;
+    additional_content_size += other.additional_content_size;
+    return *this;
+}
+
 std::ostream &operator<<(std::ostream &os, const statistic &statistic) {
     os << statistic.input_file_size << std::endl;
     os << statistic.output_content_size << std::endl;
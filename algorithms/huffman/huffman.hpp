@@ -1,19 +1,65 @@
 #pragma once
 
+#include "instrumentation.hpp"
+
 #include <cstdint>
 #include <optional>
 #include <string>
 #include <vector>
 #include <array>
+#include <algorithm>
 #include <functional>
 #include <ostream>
+#include <limits>
+#include <stdexcept>
+#include <istream>
+#include <memory>
+#include <streambuf>
+#include <thread>
+
+struct huffman_format_error : std::runtime_error {
+    explicit huffman_format_error(const std::string &string) : runtime_error(string) {}
+};
 
 std::string to_string(std::vector<bool> const &bitvector);
 
+// Legacy files have no header and start straight with 256 uint32_t frequencies, newer ones
+// start with FORMAT_MAGIC and a version byte. The magic read as the legacy frequency of '\0'
+// would mean about 1.18e9 zero bytes, so the layouts are told apart by the first four bytes.
+enum class format_version : uint8_t {
+    legacy = 0,
+    canonical = 1,
+    blocks = 2,
+    // Codes come from a dictionary trained offline, the header only names it.
+    dictionary = 3,
+    // Canonical codes with the symbols dealt round-robin to INTERLEAVED_STREAMS bitstreams.
+    interleaved = 4,
+    // Codes are rebuilt from the symbols coded so far, nothing waits for a histogram.
+    adaptive = 5,
+    // A table per preceding byte, sparse contexts share one.
+    order1 = 6,
+    // Canonical codes followed by the bit offset of every block, so ranges decode without the rest.
+    indexed = 7,
+    // Blocks coded with Huffman codes or tANS, stored or as a run each, ending with the CRC32C of their payload.
+    checked_blocks = 8,
+    // Literals, match lengths and distances of an LZ77 parse, coded with tables per block.
+    lz77 = 9,
+};
+
+// The two block layouts differ only in the checksums.
+constexpr bool is_block_format(format_version format) noexcept {
+    return format == format_version::blocks || format == format_version::checked_blocks;
+}
+
+constexpr std::array<char, 4> FORMAT_MAGIC = {'\x89', 'H', 'U', 'F'};
+constexpr size_t INTERLEAVED_STREAMS = 4;
+
 struct statistic {
     uint64_t input_file_size = 0;
     uint64_t output_content_size = 0;
-    const uint64_t additional_content_size = sizeof(uint32_t) * 256;
+    uint64_t additional_content_size = 0;
+
+    statistic &operator+=(const statistic &other);
 
     friend std::ostream &operator<<(std::ostream &os, const statistic &statistic);
 };
@@ -73,53 +119,125 @@ private:
     std::vector<std::string> _tokens;
 };
 
-struct huffman_node final {
-    huffman_node(char data, uint32_t count);
-    huffman_node(huffman_node *left_child, huffman_node *right_child, uint32_t count);
+// Value of the option `name`, throws std::invalid_argument for values that are not decimal numbers or
+// exceed `max`.
+uint64_t parse_number(const std::string &value, const std::string &name, uint64_t max = UINT64_MAX);
 
-    virtual ~huffman_node();
+// Nodes refer to their children by index into the flat array of their tree.
+struct huffman_node final {
+    static constexpr uint16_t NONE = std::numeric_limits<uint16_t>::max();
 
     [[nodiscard]] bool is_leaf() const noexcept;
-    [[nodiscard]] uint32_t weight() const noexcept;
+    [[nodiscard]] uint64_t weight() const noexcept;
 
     friend std::ostream &operator<<(std::ostream &os, const huffman_node &node);
 
-    uint8_t data;
-    uint32_t count;
+    uint64_t count = 0;
+    uint16_t left = NONE;
+    uint16_t right = NONE;
+    uint8_t data = 0;
+};
 
-    huffman_node *left = nullptr;
-    huffman_node *right = nullptr;
+// Code bits are right-aligned, the most significant one goes first into the stream.
+struct huffman_code {
+    uint64_t bits = 0;
+    uint8_t length = 0;
 };
 
+std::string to_string(const huffman_code &code);
+
 struct huffman_tree final {
     static constexpr uint32_t CHARACTERS_COUNT = std::numeric_limits<uint8_t>::max() + 1;
+    static constexpr uint8_t MAX_CODE_LENGTH = 64;
+    // Every alphabet of 256 symbols still fits into codes of this length.
+    static constexpr uint8_t MIN_CODE_LENGTH_LIMIT = 8;
 
-    using char_counter = std::array<uint32_t, huffman_tree::CHARACTERS_COUNT>;
+    using char_counter = std::array<uint64_t, huffman_tree::CHARACTERS_COUNT>;
     using table = std::array<std::vector<bool>, CHARACTERS_COUNT>;
+    using code_table = std::array<huffman_code, CHARACTERS_COUNT>;
+    using code_lengths = std::array<uint8_t, CHARACTERS_COUNT>;
+
+    static constexpr uint16_t MAX_NODES = 2 * CHARACTERS_COUNT - 1;
+
+    // Symbols with non-zero counts in ascending order of counts.
+    struct sorted_counter {
+        std::array<std::pair<uint8_t, uint64_t>, CHARACTERS_COUNT> symbols;
+        uint16_t size = 0;
 
-    explicit huffman_tree(const std::vector<std::pair<char, uint32_t>> &char_counters);
+        [[nodiscard]] auto begin() const noexcept { return symbols.begin(); }
+        [[nodiscard]] auto end() const noexcept { return symbols.begin() + size; }
+    };
+
+    // Leaves take the first slots and every merge appends a node, so the tree needs no allocations.
+    explicit huffman_tree(const sorted_counter &counter);
     huffman_tree() = default;
 
-    ~huffman_tree();
+    // Rebuilds the tree the legacy layout was written with, its decoders depend on the exact shape.
+    [[nodiscard]] static huffman_tree legacy(const char_counter &counter);
+
+    [[nodiscard]] bool empty() const noexcept;
 
     [[nodiscard]] table build_table() const;
+    [[nodiscard]] code_table build_code_table() const;
+    [[nodiscard]] code_lengths build_code_lengths() const;
 
     friend std::ostream &operator<<(std::ostream &os, const huffman_tree &tree);
-    huffman_node *root = nullptr;
+    std::array<huffman_node, MAX_NODES> nodes;
+    uint16_t root = huffman_node::NONE;
 };
 
+// Codes of the same length are consecutive numbers assigned in symbol order, so the lengths
+// alone describe the whole table.
+huffman_tree::code_table make_canonical_codes(const huffman_tree::code_lengths &lengths);
+// Whether the lengths use up the code space or give a lone symbol a 1-bit code, as every encoder does;
+// decoders that reject the rest never meet a code without a symbol. Throws huffman_format_error for
+// oversubscribed lengths.
+[[nodiscard]] bool is_complete_code(const huffman_tree::code_lengths &lengths);
+
+// Optimal code lengths that do not exceed `max_length`, found with package-merge.
+huffman_tree::code_lengths limited_code_lengths(const huffman_tree::sorted_counter &counter, uint8_t max_length);
+
+// Whether the limit is within [MIN_CODE_LENGTH_LIMIT, MAX_CODE_LENGTH], decoders check headers with it.
+[[nodiscard]] bool is_valid_code_length_limit(uint8_t max_length) noexcept;
+
+// Throws std::invalid_argument for limits is_valid_code_length_limit rejects.
+void validate_code_length_limit(uint8_t max_length);
+
+// Code lengths of the Huffman tree, recomputed with package-merge when the tree is deeper than
+// `max_length`, which validate_code_length_limit checks.
+huffman_tree::code_lengths build_code_lengths(const huffman_tree::char_counter &counter,
+                                              uint8_t max_length = huffman_tree::MAX_CODE_LENGTH);
+
+huffman_tree::char_counter count_characters(const uint8_t *data, size_t size);
+
+// Parse run-length coded code lengths and varints in place, `data` is moved past them.
+huffman_tree::code_lengths read_code_lengths(const uint8_t *&data, const uint8_t *end);
+uint64_t read_varint(const uint8_t *&data, const uint8_t *end);
+void append_code_lengths(std::vector<uint8_t> &output, const huffman_tree::code_lengths &lengths);
+// Bytes append_code_lengths writes for `lengths`.
+[[nodiscard]] size_t code_lengths_header_size(const huffman_tree::code_lengths &lengths);
+// Bits of the symbols of `counter` coded with `lengths`, without the header.
+[[nodiscard]] uint64_t coded_bits(const huffman_tree::char_counter &counter, const huffman_tree::code_lengths &lengths);
+void append_varint(std::vector<uint8_t> &output, uint64_t value);
+
 class bit_reader {
 public:
     static constexpr uint8_t MAX_BIT_OFFSET = 7;
 
     explicit bit_reader(std::istream &stream, statistic &stat);
 
-    huffman_tree::char_counter read_counter();
+    huffman_tree::char_counter read_counter(size_t from = 0);
+    huffman_tree::code_lengths read_code_lengths();
+    uint64_t read_varint();
+    uint8_t read_byte();
 
-    std::optional<char> read_huffman_char(const huffman_tree &tree);
+    // The tree is only read, so readers on other threads may walk the same one. Callers decode the
+    // symbols count of the header, a stream that ends before it throws huffman_format_error.
+    uint8_t read_huffman_char(const huffman_tree &tree);
 
-    huffman_node *current_node = nullptr;
 private:
+    bool read_bit();
+
     std::istream &stream;
     statistic &stat;
 
@@ -127,6 +245,105 @@ private:
     uint8_t buffer = 0;
 };
 
+class word_bit_reader {
+public:
+    static constexpr size_t CHUNK_SIZE = 1u << 16u;
+
+    word_bit_reader(std::istream &stream, statistic &stat);
+    word_bit_reader(const uint8_t *data, size_t size, statistic &stat);
+
+    void refill();
+
+    [[nodiscard]] uint32_t peek(uint8_t count) const noexcept {
+        return static_cast<uint32_t>(_buffer >> (64u - count));
+    }
+
+    // Takes zero bits as well, at the cost of a second shift; `count` is at most 32.
+    [[nodiscard]] uint32_t peek_bits(uint8_t count) const noexcept {
+        return static_cast<uint32_t>((_buffer >> 1u) >> (63u - count));
+    }
+
+    void consume(uint8_t count) noexcept {
+        _buffer <<= count;
+        _bits = count > _bits ? 0 : _bits - count;
+    }
+
+    [[nodiscard]] uint8_t available() const noexcept { return _bits; }
+
+private:
+    bool read_chunk();
+
+    std::istream *stream = nullptr;
+    statistic &stat;
+
+    std::vector<uint8_t> _chunk;
+    const uint8_t *_data = nullptr;
+    size_t _size = 0;
+    size_t _position = 0;
+    uint64_t _buffer = 0;
+    uint8_t _bits = 0;
+};
+
+// Multi-level lookup table: the primary level is indexed by PRIMARY_BITS bits of the stream and
+// may resolve up to MAX_SYMBOLS_PER_ENTRY short codes at once, longer codes go through subtables.
+// Decoding only reads the table, so threads decoding blocks with the same codes share one.
+class decode_table final {
+public:
+    static constexpr uint8_t PRIMARY_BITS = 11;
+    static constexpr uint8_t MAX_SYMBOLS_PER_ENTRY = 3;
+
+    struct entry {
+        uint32_t link = 0;
+        std::array<uint8_t, MAX_SYMBOLS_PER_ENTRY> symbols{};
+        // Bits consumed up to and including every symbol, for links the index bits of the level.
+        std::array<uint8_t, MAX_SYMBOLS_PER_ENTRY> lengths{};
+        uint8_t count = 0;
+        uint8_t sub_bits = 0;
+
+        [[nodiscard]] bool is_link() const noexcept { return count == 0 && sub_bits != 0; }
+    };
+
+    decode_table() = default;
+    explicit decode_table(const huffman_tree::code_table &codes);
+
+    [[nodiscard]] const entry &operator[](uint32_t index) const noexcept { return _entries[index]; }
+
+    [[nodiscard]] bool empty() const noexcept { return _entries.empty(); }
+
+    // Decodes exactly `count` symbols, a multi-symbol entry is cut at the requested count.
+    void decode(word_bit_reader &bits, uint8_t *output, size_t count) const;
+    // Symbol i comes from stream i % INTERLEAVED_STREAMS. The streams are independent, so stepping
+    // them in lockstep overlaps their lookups; `count` has to keep later calls aligned to the streams.
+    void decode(std::array<word_bit_reader, INTERLEAVED_STREAMS> &bits, uint8_t *output, size_t count) const;
+
+    // A single symbol, for callers that switch tables between symbols.
+    uint8_t decode_symbol(word_bit_reader &bits) const {
+        if (bits.available() < PRIMARY_BITS)
+            bits.refill();
+        // lookup() throws for an empty table, which has no primary entries to peek at.
+        const auto *entry = _entries.empty() ? nullptr : &_entries[bits.peek(PRIMARY_BITS)];
+        if (entry == nullptr || entry->count == 0 || bits.available() == 0)
+            entry = &lookup(bits);
+        bits.consume(entry->lengths[0]);
+        return entry->symbols[0];
+    }
+
+private:
+    struct symbol_code {
+        uint64_t bits;
+        uint8_t length;
+        uint8_t symbol;
+    };
+
+    [[nodiscard]] const entry &lookup(word_bit_reader &bits) const;
+    template<size_t STRIDE>
+    void decode_strided(word_bit_reader &bits, uint8_t *output, size_t count) const;
+    void fill(size_t offset, uint8_t table_bits, uint8_t consumed, const std::vector<symbol_code> &codes);
+    void combine_primary();
+
+    std::vector<entry> _entries;
+};
+
 class bit_writer {
 public:
     static constexpr std::uint8_t MAX_BUFFER_SIZE = sizeof(std::uint8_t) * 8;
@@ -135,6 +352,11 @@ public:
 
     void write(uint32_t value);
     void write(const std::vector<bool> &bitset);
+    void write(const huffman_code &code);
+
+    void write_varint(uint64_t value);
+    void write_code_lengths(const huffman_tree::code_lengths &lengths);
+    void write_header(format_version version);
 
     void finish();
 private:
@@ -145,28 +367,178 @@ private:
     std::uint8_t _buffer = 0;
 };
 
+// Accumulates codes in a 64-bit register and appends them to the output 32 bits at a time,
+// the encoding hot loop is a table load, a shift and an OR.
+class word_bit_writer {
+public:
+    explicit word_bit_writer(std::vector<uint8_t> &output);
+
+    void write(const huffman_code &code) {
+        write(code.bits, code.length);
+    }
+
+    void write(uint64_t bits, uint8_t length) {
+        if (length > 32) {
+            write(bits >> 32u, length - 32);
+            bits &= 0xffffffffu;
+            length = 32;
+        }
+
+        _buffer = _buffer << length | bits;
+        _count += length;
+        if (_count >= 32) {
+            _count -= 32;
+            write_word(static_cast<uint32_t>(_buffer >> _count));
+        }
+    }
+
+    // Moves the complete bytes written so far into the stream, pending bits stay in the register.
+    size_t flush(std::ostream &stream);
+
+    // Pads the last byte with zeros and shrinks the output to the written size.
+    void finish();
+
+    [[nodiscard]] size_t size() const noexcept { return _position; }
+
+    // Bits written since the last flush, the pending ones included.
+    [[nodiscard]] uint64_t pending_bits() const noexcept { return uint64_t(_position) * 8 + _count; }
+
+private:
+    void write_word(uint32_t word) {
+        if (_position + sizeof(word) > _output.size())
+            _output.resize(std::max<size_t>(_output.size() * 2, 1u << 12u));
+        for (uint8_t shift = 32; shift > 0;) {
+            shift -= 8;
+            _output[_position++] = static_cast<uint8_t>(word >> shift);
+        }
+    }
+
+    std::vector<uint8_t> &_output;
+    size_t _position;
+    uint64_t _buffer = 0;
+    uint8_t _count = 0;
+};
+
+// The interleaved payload: sizes of all bitstreams but the last, then the bitstreams.
+void append_interleaved(std::vector<uint8_t> &output, const uint8_t *data, size_t size,
+                        const huffman_tree::code_table &codes);
+// Readers over the bitstreams of an interleaved payload, `data` has to outlive them.
+std::array<word_bit_reader, INTERLEAVED_STREAMS> open_interleaved(const uint8_t *data, const uint8_t *end,
+                                                                  statistic &stats);
+
+enum class decoding_engine {
+    tree,
+    table
+};
+
+// Read-only stream over memory that is not owned, nothing is copied on construction.
+class memory_streambuf final : public std::streambuf {
+public:
+    memory_streambuf(const uint8_t *data, size_t size);
+
+    [[nodiscard]] size_t position() const noexcept { return gptr() - eback(); }
+
+protected:
+    pos_type seekoff(off_type offset, std::ios_base::seekdir direction, std::ios_base::openmode which) override;
+    pos_type seekpos(pos_type position, std::ios_base::openmode which) override;
+};
+
+class memory_istream final : public std::istream {
+public:
+    memory_istream(const uint8_t *data, size_t size);
+
+    [[nodiscard]] size_t position() const noexcept { return _buffer.position(); }
+
+private:
+    memory_streambuf _buffer;
+};
+
 class huffman_decoder final {
+    // Set when decoding from memory, goes first to outlive the reader.
+    std::unique_ptr<memory_istream> _memory_stream;
+
 public:
+    static constexpr size_t OUTPUT_BUFFER_SIZE = 1u << 16u;
+
+    explicit huffman_decoder(std::istream &stream, decoding_engine engine = decoding_engine::table,
+                             size_t threads = std::thread::hardware_concurrency());
+    huffman_decoder(const uint8_t *data, size_t size, decoding_engine engine = decoding_engine::table,
+                    size_t threads = std::thread::hardware_concurrency());
+
+    huffman_decoder(const huffman_decoder &) = delete;
+    huffman_decoder &operator=(const huffman_decoder &) = delete;
 
-    explicit huffman_decoder(std::istream &stream);
+    ~huffman_decoder();
 
     void decode(std::ostream &output_stream);
+    // Fills `output` with up to `capacity` bytes and returns their number, zero once the stream is over.
+    // Every call goes on where the last one stopped, so callers decode in loops over buffers of their
+    // own. The single table layouts decode straight into `output`; block, adaptive and LZ77 frames are
+    // decoded one at a time on the calling thread and handed out from there. Does not mix with the
+    // other decode calls.
+    size_t decode(uint8_t *output, size_t capacity);
+    // Decodes `length` symbols from `start` on, only the indexed layout can seek to them.
+    void decode_range(uint64_t start, uint64_t length, std::ostream &output_stream);
 
     statistic stats;
     bit_reader reader;
+    format_version format = format_version::legacy;
+    uint64_t symbols_count = 0;
+    // Frequencies and the tree are only stored in the legacy layout, the tree walk needs them.
+    huffman_tree::char_counter counter{};
     huffman_tree tree;
+    huffman_tree::code_table codes;
+    decoding_engine engine;
+    size_t threads;
+    uint64_t block_size = 0;
+
+private:
+    struct bulk_state;
+
+    void read_header();
+    void start_bulk();
+    size_t decode_symbols(uint8_t *output, size_t capacity);
+    // The input past the header in memory, `content` holds it unless it is mapped already.
+    std::pair<const uint8_t *, const uint8_t *> remaining_input(std::vector<uint8_t> &content);
+
+    std::istream &stream;
+    const uint8_t *_data = nullptr;
+    size_t _size = 0;
+    // Where decode(uint8_t *, size_t) stopped, set up by its first call.
+    std::unique_ptr<bulk_state> _bulk;
 };
 
 class huffman_encoder final {
 public:
 
-    explicit huffman_encoder(std::istream &stream);
+    static constexpr size_t INPUT_BUFFER_SIZE = 1u << 16u;
+    static constexpr uint64_t DEFAULT_INDEX_BLOCK_SIZE = 1u << 16u;
+
+    // Codes longer than `max_code_length` are not emitted, the legacy layout can not limit them.
+    explicit huffman_encoder(std::istream &stream, format_version format = format_version::canonical,
+                             uint8_t max_code_length = huffman_tree::MAX_CODE_LENGTH);
+    huffman_encoder(const uint8_t *data, size_t size, format_version format = format_version::canonical,
+                    uint8_t max_code_length = huffman_tree::MAX_CODE_LENGTH);
 
     void encode(std::istream &input_stream, std::ostream &output_stream);
+    void encode(const uint8_t *data, size_t size, std::ostream &output_stream);
+
+    [[nodiscard]] huffman_tree::code_table build_codes() const;
 
     statistic stats;
-    huffman_tree::char_counter counter;
+    encoder_metrics metrics;
+    huffman_tree::char_counter counter{};
     huffman_tree tree;
+    format_version format;
+    huffman_tree::code_lengths lengths{};
+    // Symbols between the entries of the block index of the indexed layout.
+    uint64_t index_block_size = DEFAULT_INDEX_BLOCK_SIZE;
+
+private:
+    void build_tree(uint8_t max_code_length);
+    huffman_tree::code_table start_encoding(std::ostream &output_stream);
+    void write_header(bit_writer &writer);
+    void write_index(const std::vector<uint64_t> &index, std::ostream &output_stream);
 };
 
-std::vector<std::pair<char, uint32_t>> prepare_counter(const huffman_tree::char_counter &counter);
\ No newline at end of file
+huffman_tree::sorted_counter prepare_counter(const huffman_tree::char_counter &counter);
\ No newline at end of file
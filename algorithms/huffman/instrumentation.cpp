@@ -0,0 +1,54 @@
+#include "instrumentation.hpp"
+#include "huffman.hpp"
+
+#include <atomic>
+#include <cmath>
+
+namespace {
+    std::atomic<allocation_counter> installed_counter{nullptr};
+
+    uint64_t total(const byte_histogram &histogram) noexcept {
+        uint64_t sum = 0;
+        for (const auto count : histogram)
+            sum += count;
+        return sum;
+    }
+}
+
+std::chrono::nanoseconds encoder_metrics::total_time() const noexcept {
+    std::chrono::nanoseconds sum{};
+    for (const auto time : times)
+        sum += time;
+    return sum;
+}
+
+double encoder_metrics::bytes_per_second() const noexcept {
+    const auto seconds = std::chrono::duration<double>(total_time()).count();
+    return seconds > 0 ? double(input_bytes) / seconds : 0.0;
+}
+
+void set_allocation_counter(allocation_counter counter) noexcept {
+    installed_counter.store(counter, std::memory_order_relaxed);
+}
+
+uint64_t counted_allocations() noexcept {
+    const auto counter = installed_counter.load(std::memory_order_relaxed);
+    return counter != nullptr ? counter() : 0;
+}
+
+double shannon_entropy(const byte_histogram &histogram) noexcept {
+    const auto size = total(histogram);
+    double entropy = 0;
+    for (const auto count : histogram) {
+        if (count != 0)
+            entropy -= double(count) / size * std::log2(double(count) / size);
+    }
+    return entropy;
+}
+
+double average_code_length(const byte_histogram &histogram, const std::array<uint8_t, 256> &lengths) noexcept {
+    const auto size = total(histogram);
+    if (size == 0)
+        return 0;
+    return double(coded_bits(histogram, lengths)) / size;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "histogram.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Where the time and the bits of an encoding went.
+struct encoder_metrics {
+    enum phase : size_t {
+        histogram,
+        tree,
+        table,
+        encode,
+        // Writing the header and the coded bytes to the output stream.
+        flush,
+        PHASES_COUNT
+    };
+
+    static constexpr std::array<const char *, PHASES_COUNT> PHASE_NAMES = {
+        "histogram", "tree", "table", "encode", "flush"
+    };
+
+    std::array<std::chrono::nanoseconds, PHASES_COUNT> times{};
+    // Order-0 Shannon entropy of the input and the code bits spent per input byte, the difference
+    // is what the code lengths lose against an ideal coder.
+    double entropy = 0;
+    double average_code_length = 0;
+    uint64_t input_bytes = 0;
+    // Made during the phases, as told by the counter set_allocation_counter installs, zero without one.
+    uint64_t allocations = 0;
+
+    [[nodiscard]] std::chrono::nanoseconds total_time() const noexcept;
+    // Of the input over the time of all phases, zero before any time is recorded.
+    [[nodiscard]] double bytes_per_second() const noexcept;
+};
+
+// Allocations made so far. The codec does not replace operator new, executables that do install
+// their counter; it counts the whole process, so work on other threads shows up in the metrics too.
+using allocation_counter = uint64_t (*)() noexcept;
+void set_allocation_counter(allocation_counter counter) noexcept;
+[[nodiscard]] uint64_t counted_allocations() noexcept;
+
+// Adds the time between its construction and destruction to one phase, and the allocations to the metrics.
+class phase_timer final {
+public:
+    phase_timer(encoder_metrics &metrics, encoder_metrics::phase phase) noexcept
+        : _metrics(metrics), _phase(phase), _allocations(counted_allocations()),
+          _start(std::chrono::steady_clock::now()) {}
+
+    phase_timer(const phase_timer &) = delete;
+    phase_timer &operator=(const phase_timer &) = delete;
+
+    ~phase_timer() {
+        _metrics.times[_phase] +=
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start);
+        _metrics.allocations += counted_allocations() - _allocations;
+    }
+
+private:
+    encoder_metrics &_metrics;
+    encoder_metrics::phase _phase;
+    uint64_t _allocations;
+    std::chrono::steady_clock::time_point _start;
+};
+
+[[nodiscard]] double shannon_entropy(const byte_histogram &histogram) noexcept;
+[[nodiscard]] double average_code_length(const byte_histogram &histogram,
+                                         const std::array<uint8_t, 256> &lengths) noexcept;
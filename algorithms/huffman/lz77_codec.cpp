@@ -0,0 +1,403 @@
+#include "lz77_codec.hpp"
+#include "histogram.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+namespace {
+    enum table_kind {
+        literals,
+        literal_runs,
+        match_lengths,
+        distances,
+        TABLES_COUNT
+    };
+
+    constexpr uint8_t DIRECT_VALUES = 16;
+    constexpr uint8_t MIN_OCTAVE = 4;
+    // The bucket of the largest 32-bit value.
+    constexpr uint8_t MAX_VALUE_CODE = DIRECT_VALUES + 2 * (31 - MIN_OCTAVE) + 1;
+    constexpr uint8_t HASH_BITS = 16;
+    constexpr size_t NONE = std::numeric_limits<size_t>::max();
+
+    struct bucket {
+        uint8_t code;
+        uint8_t extra_bits;
+        uint32_t extra;
+    };
+
+    bucket to_bucket(uint32_t value) {
+        if (value < DIRECT_VALUES)
+            return {static_cast<uint8_t>(value), 0, 0};
+        const auto octave = static_cast<uint8_t>(31 - __builtin_clz(value));
+        const auto extra_bits = static_cast<uint8_t>(octave - 1);
+        const auto code = DIRECT_VALUES + 2 * (octave - MIN_OCTAVE) + ((value >> extra_bits) & 1u);
+        return {static_cast<uint8_t>(code), extra_bits, value & ((1u << extra_bits) - 1)};
+    }
+
+    // How thoroughly a level searches: chains are cut after `max_chain` candidates or at a match of
+    // `nice_length`, lazy levels also try the next byte before they take a match and search only a
+    // quarter of the chain for it once the match has `good_length`. The positions inside matches longer
+    // than `max_insert_length` are not linked, which speeds up the fast levels. Levels 4 to 9 take the
+    // chain, nice and good lengths of zlib's, levels 1 to 3 only its insert limits: their chains are
+    // half as long or shorter and their nice lengths differ.
+    struct lz77_level {
+        uint32_t max_chain;
+        size_t nice_length;
+        size_t good_length;
+        size_t max_insert_length;
+        bool is_lazy;
+    };
+
+    constexpr std::array<lz77_level, lz77_options::MAX_LEVEL> LEVELS = {{
+        {2, 16, 0, 4, false},
+        {4, 32, 0, 5, false},
+        {8, 32, 0, 6, false},
+        {16, 16, 4, lz77_encoder::MAX_MATCH, true},
+        {32, 32, 8, lz77_encoder::MAX_MATCH, true},
+        {128, 128, 8, lz77_encoder::MAX_MATCH, true},
+        {256, 128, 8, lz77_encoder::MAX_MATCH, true},
+        {1024, 258, 32, lz77_encoder::MAX_MATCH, true},
+        {4096, 258, 32, lz77_encoder::MAX_MATCH, true},
+    }};
+
+    uint32_t load32(const uint8_t *data) {
+        uint32_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    uint64_t load64(const uint8_t *data) {
+        uint64_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    uint32_t hash(const uint8_t *data) {
+        return load32(data) * 2654435761u >> (32u - HASH_BITS);
+    }
+
+    // Compares 8 bytes at a time, the lowest differing bit of the little-endian words marks the mismatch.
+    size_t match_length(const uint8_t *earlier, const uint8_t *current, size_t max_length) {
+        size_t length = 0;
+        for (; length + sizeof(uint64_t) <= max_length; length += sizeof(uint64_t)) {
+            const auto difference = load64(earlier + length) ^ load64(current + length);
+            if (difference != 0)
+                return length + __builtin_ctzll(difference) / 8;
+        }
+        while (length < max_length && earlier[length] == current[length])
+            ++length;
+        return length;
+    }
+
+    struct match {
+        size_t length = 0;
+        size_t distance = 0;
+    };
+
+    // Chains of earlier positions with the same hash of their first MIN_MATCH bytes, newest first.
+    // Only the last WINDOW_SIZE positions are linked, older ones end the chain.
+    class match_finder {
+    public:
+        match_finder(const uint8_t *data, size_t size, const lz77_level &level)
+            : _data(data), _size(size), _level(level), _head(size_t(1) << HASH_BITS, NONE),
+              _previous(lz77_encoder::WINDOW_SIZE, NONE) {
+        }
+
+        // Links every position before `position` that still has MIN_MATCH bytes after it.
+        void insert_until(size_t position) {
+            const auto last = std::min(position, _size < lz77_encoder::MIN_MATCH ? 0 : _size - lz77_encoder::MIN_MATCH + 1);
+            for (; _inserted < last; ++_inserted) {
+                auto &head = _head[hash(_data + _inserted)];
+                _previous[_inserted % lz77_encoder::WINDOW_SIZE] = head;
+                head = _inserted;
+            }
+        }
+
+        // Leaves the positions before `position` out of the chains.
+        void skip_to(size_t position) {
+            _inserted = std::max(_inserted, position);
+        }
+
+        // The longest match for `position` among `max_chain` linked positions that ends by `end`, its
+        // length is zero when there is none of MIN_MATCH bytes.
+        [[nodiscard]] match find(size_t position, size_t end, uint32_t max_chain) const {
+            match best;
+            if (end - position < lz77_encoder::MIN_MATCH)
+                return best;
+
+            const auto max_length = std::min<size_t>(end - position, lz77_encoder::MAX_MATCH);
+            const auto *current = _data + position;
+            best.length = lz77_encoder::MIN_MATCH - 1;
+            auto candidate = _head[hash(current)];
+            for (auto chain = max_chain; chain > 0 && candidate != NONE; --chain) {
+                if (position - candidate > lz77_encoder::WINDOW_SIZE)
+                    break;
+                const auto *earlier = _data + candidate;
+                // Only a longer match replaces the best one, the byte that would make it longer is tried first.
+                if (earlier[best.length] == current[best.length]) {
+                    const auto length = match_length(earlier, current, max_length);
+                    if (length > best.length) {
+                        best = {length, position - candidate};
+                        if (length >= _level.nice_length || length == max_length)
+                            break;
+                    }
+                }
+                candidate = _previous[candidate % lz77_encoder::WINDOW_SIZE];
+            }
+
+            if (best.distance == 0)
+                best.length = 0;
+            return best;
+        }
+
+    private:
+        const uint8_t *_data;
+        size_t _size;
+        const lz77_level &_level;
+        std::vector<size_t> _head;
+        std::vector<size_t> _previous;
+        size_t _inserted = 0;
+    };
+
+    void write_value(word_bit_writer &writer, const huffman_tree::code_table &codes, uint32_t value) {
+        const auto value_bucket = to_bucket(value);
+        writer.write(codes[value_bucket.code]);
+        if (value_bucket.extra_bits != 0)
+            writer.write(value_bucket.extra, value_bucket.extra_bits);
+    }
+
+    uint32_t read_value(word_bit_reader &bits, const decode_table &table) {
+        if (table.empty())
+            throw huffman_format_error("invalid lz77 block");
+        const auto code = table.decode_symbol(bits);
+        if (code < DIRECT_VALUES)
+            return code;
+        if (code > MAX_VALUE_CODE)
+            throw huffman_format_error("invalid lz77 block");
+
+        const auto extra_bits = static_cast<uint8_t>((code - DIRECT_VALUES) / 2 + MIN_OCTAVE - 1);
+        if (bits.available() < extra_bits)
+            bits.refill();
+        if (bits.available() < extra_bits)
+            throw huffman_format_error("truncated lz77 block");
+        const auto extra = bits.peek(extra_bits);
+        bits.consume(extra_bits);
+        return (2u | ((code - DIRECT_VALUES) & 1u)) << extra_bits | extra;
+    }
+
+    void decode_literals(word_bit_reader &bits, const decode_table &table, uint8_t *output, size_t count) {
+        if (count == 0)
+            return;
+        if (table.empty())
+            throw huffman_format_error("invalid lz77 block");
+        table.decode(bits, output, count);
+    }
+
+    // Matches may overlap their own output, words are only copied when the source stays behind them.
+    void copy_match(uint8_t *output, size_t distance, size_t length) {
+        const auto *source = output - distance;
+        if (distance == 1) {
+            std::memset(output, *source, length);
+            return;
+        }
+
+        size_t copied = 0;
+        if (distance >= sizeof(uint64_t)) {
+            for (; copied + sizeof(uint64_t) <= length; copied += sizeof(uint64_t))
+                std::memcpy(output + copied, source + copied, sizeof(uint64_t));
+        }
+        for (; copied < length; ++copied)
+            output[copied] = source[copied];
+    }
+}
+
+lz77_encoder::lz77_encoder(lz77_options options): options(options) {
+    if (options.level < lz77_options::MIN_LEVEL || options.level > lz77_options::MAX_LEVEL)
+        throw std::invalid_argument("compression level must be within [1, 9]");
+    validate_code_length_limit(options.max_code_length);
+}
+
+void lz77_encoder::encode(const uint8_t *data, size_t size, std::ostream &output_stream) {
+    bit_writer header_writer(output_stream, stats);
+    header_writer.write_header(format_version::lz77);
+    header_writer.write_varint(size);
+    stats.input_file_size += size;
+
+    const auto &level = LEVELS[options.level - lz77_options::MIN_LEVEL];
+    match_finder finder(data, size, level);
+    for (size_t start = 0; start < size; start += BLOCK_SIZE) {
+        const auto end = std::min(size, start + BLOCK_SIZE);
+        _sequences.clear();
+        auto literal_start = start;
+        for (auto position = start; position < end;) {
+            finder.insert_until(position);
+            auto best = finder.find(position, end, level.max_chain);
+            if (best.length == 0) {
+                ++position;
+                continue;
+            }
+            // A longer match at the next byte wins over the current one, which becomes a literal.
+            while (level.is_lazy && best.length < level.nice_length && position + 1 < end) {
+                finder.insert_until(position + 1);
+                const auto chain = best.length >= level.good_length ? level.max_chain / 4 : level.max_chain;
+                const auto next = finder.find(position + 1, end, chain);
+                if (next.length <= best.length)
+                    break;
+                ++position;
+                best = next;
+            }
+
+            _sequences.push_back({static_cast<uint32_t>(position - literal_start), static_cast<uint32_t>(best.length),
+                                  static_cast<uint32_t>(best.distance)});
+            position += best.length;
+            literal_start = position;
+            if (best.length > level.max_insert_length)
+                finder.skip_to(position);
+        }
+        write_block(data + start, end - start, output_stream);
+    }
+}
+
+void lz77_encoder::write_block(const uint8_t *block, size_t size, std::ostream &output_stream) {
+    // Literal runs are short, the histogram kernels would spend more on merging their sub-histograms.
+    std::array<huffman_tree::char_counter, TABLES_COUNT> counters{};
+    uint64_t extra_bits = 0;
+    const auto *position = block;
+    for (const auto &sequence : _sequences) {
+        for (const auto *literals_end = position + sequence.literals; position != literals_end; ++position)
+            ++counters[literals][*position];
+        for (const auto &[table, value] : {std::pair(literal_runs, sequence.literals),
+                                          std::pair(match_lengths, sequence.length - MIN_MATCH),
+                                          std::pair(distances, sequence.distance - 1)}) {
+            const auto value_bucket = to_bucket(value);
+            ++counters[table][value_bucket.code];
+            extra_bits += value_bucket.extra_bits;
+        }
+        position += sequence.length;
+    }
+    accumulate_histogram(position, block + size - position, counters[literals]);
+
+    std::array<huffman_tree::code_lengths, TABLES_COUNT> lengths;
+    uint64_t parse_bits = extra_bits;
+    for (size_t table = 0; table < TABLES_COUNT; ++table) {
+        lengths[table] = build_code_lengths(counters[table], options.max_code_length);
+        parse_bits += coded_bits(counters[table], lengths[table]) + code_lengths_header_size(lengths[table]) * 8;
+    }
+
+    // On data without repeats the short matches cost more than the literals they replace, such a
+    // block is coded as literals only.
+    if (!_sequences.empty()) {
+        const auto counter = count_characters(block, size);
+        const auto literal_lengths = build_code_lengths(counter, options.max_code_length);
+        if (coded_bits(counter, literal_lengths) + code_lengths_header_size(literal_lengths) * 8 < parse_bits) {
+            _sequences.clear();
+            counters = {};
+            counters[literals] = counter;
+            lengths = {};
+            lengths[literals] = literal_lengths;
+        }
+    }
+
+    bit_writer writer(output_stream, stats);
+    writer.write_varint(size);
+    writer.write_varint(_sequences.size());
+    std::array<huffman_tree::code_table, TABLES_COUNT> codes;
+    for (size_t table = 0; table < TABLES_COUNT; ++table) {
+        writer.write_code_lengths(lengths[table]);
+        codes[table] = make_canonical_codes(lengths[table]);
+    }
+
+    _payload.clear();
+    word_bit_writer payload_writer(_payload);
+    position = block;
+    for (const auto &sequence : _sequences) {
+        write_value(payload_writer, codes[literal_runs], sequence.literals);
+        for (const auto *literals_end = position + sequence.literals; position != literals_end; ++position)
+            payload_writer.write(codes[literals][*position]);
+        write_value(payload_writer, codes[match_lengths], sequence.length - MIN_MATCH);
+        write_value(payload_writer, codes[distances], sequence.distance - 1);
+        position += sequence.length;
+    }
+    for (const auto *end = block + size; position != end; ++position)
+        payload_writer.write(codes[literals][*position]);
+    payload_writer.finish();
+
+    writer.write_varint(_payload.size());
+    output_stream.write(reinterpret_cast<const char *>(_payload.data()), _payload.size());
+    stats.output_content_size += _payload.size();
+}
+
+size_t decode_lz77_block(const uint8_t *&data, const uint8_t *end, const uint8_t *history, uint8_t *output,
+                         size_t capacity, statistic &stats) {
+    const auto *start = data;
+    const auto size = read_varint(data, end);
+    const auto sequences = read_varint(data, end);
+    if (size == 0 || size > capacity || sequences > size / lz77_encoder::MIN_MATCH)
+        throw huffman_format_error("invalid lz77 block");
+
+    std::array<decode_table, TABLES_COUNT> tables;
+    for (auto &table : tables)
+        table = decode_table(make_canonical_codes(read_code_lengths(data, end)));
+    const auto payload_size = read_varint(data, end);
+    if (payload_size > uint64_t(end - data))
+        throw huffman_format_error("truncated lz77 block");
+    stats.additional_content_size += data - start;
+
+    word_bit_reader bits(data, payload_size, stats);
+    data += payload_size;
+    auto *position = output;
+    const auto *output_end = output + size;
+    for (uint64_t sequence = 0; sequence < sequences; ++sequence) {
+        const auto literals_count = read_value(bits, tables[literal_runs]);
+        if (literals_count > uint64_t(output_end - position))
+            throw huffman_format_error("invalid lz77 block");
+        decode_literals(bits, tables[literals], position, literals_count);
+        position += literals_count;
+
+        const auto length = uint64_t(read_value(bits, tables[match_lengths])) + lz77_encoder::MIN_MATCH;
+        const auto distance = uint64_t(read_value(bits, tables[distances])) + 1;
+        if (length > uint64_t(output_end - position) || distance > uint64_t(position - history) ||
+            distance > lz77_encoder::WINDOW_SIZE)
+            throw huffman_format_error("invalid lz77 match");
+        copy_match(position, distance, length);
+        position += length;
+    }
+    decode_literals(bits, tables[literals], position, output_end - position);
+
+    stats.output_content_size += size;
+    return size;
+}
+
+void decode_lz77(const uint8_t *data, const uint8_t *end, uint64_t size, std::ostream &output_stream,
+                 statistic &stats) {
+    lz77_stream_decoder decoder(data, end, size, stats);
+    while (const auto block_size = decoder.decode_next())
+        output_stream.write(reinterpret_cast<const char *>(decoder.output()), block_size);
+}
+
+lz77_stream_decoder::lz77_stream_decoder(const uint8_t *data, const uint8_t *end, uint64_t size, statistic &stats)
+    : _data(data),
+      _end(end),
+      _remaining(size),
+      _stats(stats),
+      _window(lz77_encoder::WINDOW_SIZE + lz77_encoder::BLOCK_SIZE) {
+}
+
+size_t lz77_stream_decoder::decode_next() {
+    if (_remaining == 0)
+        return 0;
+    if (_kept > lz77_encoder::WINDOW_SIZE) {
+        std::memmove(_window.data(), _window.data() + _kept - lz77_encoder::WINDOW_SIZE, lz77_encoder::WINDOW_SIZE);
+        _kept = lz77_encoder::WINDOW_SIZE;
+    }
+
+    const auto capacity = static_cast<size_t>(std::min<uint64_t>(_remaining, lz77_encoder::BLOCK_SIZE));
+    _block_start = _kept;
+    const auto block_size = decode_lz77_block(_data, _end, _window.data(), _window.data() + _kept, capacity, _stats);
+    _remaining -= block_size;
+    _kept += block_size;
+    return block_size;
+}
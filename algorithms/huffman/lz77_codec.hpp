@@ -0,0 +1,85 @@
+#pragma once
+
+#include "huffman.hpp"
+
+#include <array>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+// LZ77 layout: a hash-chain match finder turns the input into sequences of a literal run followed by
+// a match of (length, distance) into the last WINDOW_SIZE bytes, as in DEFLATE. Every block after the
+// raw size of the header holds its raw size, the sequences count, the code lengths of four tables
+// (literals, literal run lengths, match lengths and distances), the payload size and the payload. The
+// bytes after the last sequence of a block are literals. Values are coded by bucket: those under
+// DIRECT_VALUES are codes of their own, larger ones are two buckets per power of two with the bits
+// below the top two following the code.
+struct lz77_options {
+    static constexpr uint8_t MIN_LEVEL = 1;
+    static constexpr uint8_t MAX_LEVEL = 9;
+    static constexpr uint8_t DEFAULT_LEVEL = 6;
+    // The four tables are rebuilt for every block, short codes keep them cheap as in DEFLATE.
+    static constexpr uint8_t DEFAULT_MAX_CODE_LENGTH = 15;
+
+    uint8_t level = DEFAULT_LEVEL;
+    uint8_t max_code_length = DEFAULT_MAX_CODE_LENGTH;
+};
+
+class lz77_encoder final {
+public:
+    static constexpr size_t WINDOW_SIZE = 1u << 16u;
+    static constexpr size_t BLOCK_SIZE = 1u << 18u;
+    static constexpr uint32_t MIN_MATCH = 4;
+    static constexpr uint32_t MAX_MATCH = 1u << 16u;
+
+    // Throws std::invalid_argument for a level outside [1, 9] or a limit outside [8, 64].
+    explicit lz77_encoder(lz77_options options = {});
+
+    // Matches reach back across blocks, the whole input has to be at hand.
+    void encode(const uint8_t *data, size_t size, std::ostream &output_stream);
+
+    statistic stats;
+    lz77_options options;
+
+private:
+    struct sequence {
+        uint32_t literals;
+        uint32_t length;
+        uint32_t distance;
+    };
+
+    void write_block(const uint8_t *block, size_t size, std::ostream &output_stream);
+
+    std::vector<sequence> _sequences;
+    std::vector<uint8_t> _payload;
+};
+
+// Decodes a block to `output`, matches may reach back to `history`. Returns its raw size, which is at
+// most `capacity`, and moves `data` past it. Throws huffman_format_error for blocks no encoder writes.
+size_t decode_lz77_block(const uint8_t *&data, const uint8_t *end, const uint8_t *history, uint8_t *output,
+                         size_t capacity, statistic &stats);
+
+// Decodes the blocks of `size` bytes that follow the raw size of the header.
+void decode_lz77(const uint8_t *data, const uint8_t *end, uint64_t size, std::ostream &output_stream,
+                 statistic &stats);
+
+// Decodes the same blocks one at a time, for callers that pull the content. `data` has to outlive it.
+class lz77_stream_decoder final {
+public:
+    lz77_stream_decoder(const uint8_t *data, const uint8_t *end, uint64_t size, statistic &stats);
+
+    // Returns the size of the next block, zero after the last one; output() holds it until the next call.
+    size_t decode_next();
+
+    [[nodiscard]] const uint8_t *output() const noexcept { return _window.data() + _block_start; }
+
+private:
+    const uint8_t *_data;
+    const uint8_t *_end;
+    uint64_t _remaining;
+    statistic &_stats;
+    // Blocks are decoded behind the window they may reach back to, which then slides over them.
+    std::vector<uint8_t> _window;
+    size_t _kept = 0;
+    size_t _block_start = 0;
+};
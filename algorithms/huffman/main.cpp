@@ -1,88 +1,599 @@
 #include "huffman.hpp"
+#include "allocation_counter.hpp"
+#include "adaptive_codec.hpp"
+#include "archive.hpp"
+#include "block_codec.hpp"
+#include "buffer_codec.hpp"
+#include "dictionary.hpp"
+#include "instrumentation.hpp"
+#include "lz77_codec.hpp"
+#include "mapped_file.hpp"
+#include "order1_codec.hpp"
 
 #include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
 #include <string>
 #include <optional>
 #include <fstream>
 #include <ostream>
 #include <iostream>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
 
 namespace {
-    void verbose(const huffman_tree &tree) {
-        auto table = tree.build_table();
-        std::vector<std::pair<int16_t, std::vector<bool>>> pairs;
+    void verbose(const huffman_tree::code_table &table, std::ostream &os) {
+        std::vector<std::pair<int16_t, std::string>> pairs;
 
         for (uint64_t offset = 0; offset < table.size(); ++offset) {
-            if (!table[offset].empty())
-                pairs.emplace_back(offset, table[offset]);
+            if (table[offset].length != 0)
+                pairs.emplace_back(offset, to_string(table[offset]));
         }
         std::sort(pairs.begin(), pairs.end(), [](auto lhs, auto rhs) {
             return lhs.second < rhs.second;
         });
 
         for (const auto &content: pairs) {
-            std::cout << to_string(content.second) << " " << content.first << std::endl;
+            os << content.second << " " << content.first << std::endl;
         }
     }
 
-    void make_compress(const std::string &input_file, const std::string &output_file, bool is_verbose) {
-        std::ifstream input_stream(input_file, std::ios::binary);
-        input_stream >> std::noskipws;
-        std::ofstream output_stream(output_file, std::ios_base::binary);
-        huffman_encoder encoder(input_stream);
-        input_stream.clear();
-        input_stream.seekg(0, std::ios::beg);
+    constexpr size_t OUTPUT_BUFFER_SIZE = 1u << 20u;
+    const std::string STANDARD_STREAM = "-";
 
-        encoder.encode(input_stream, output_stream);
+    struct codec_options {
+        format_version format = format_version::canonical;
+        block_options blocks;
+        adaptive_options adaptive;
+        lz77_options lz77;
+        uint64_t index_block_size = huffman_encoder::DEFAULT_INDEX_BLOCK_SIZE;
+        // Start and length of the part of an indexed stream to decode.
+        std::optional<std::pair<uint64_t, uint64_t>> range;
+        bool is_verbose = false;
+        // Blocks are read, encoded and written by stages on their own threads.
+        bool is_pipelined = false;
+        std::optional<huffman_dictionary> dictionary;
+        // Statistics go to stderr while stdout carries the data.
+        std::ostream *report = &std::cout;
+        // --stats=json reports throughput, allocations and the phases of the encoder besides the sizes.
+        bool is_json_report = false;
+        bool is_compressing = false;
+        std::chrono::steady_clock::time_point started;
+        uint64_t allocations = 0;
+    };
+
+    void write_json(const statistic &stats, const codec_options &options, const encoder_metrics *metrics) {
+        const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - options.started).count();
+        const auto compressed_size = options.is_compressing
+                                     ? stats.output_content_size + stats.additional_content_size
+                                     : stats.input_file_size + stats.additional_content_size;
+        const auto raw_size = options.is_compressing ? stats.input_file_size : stats.output_content_size;
+
+        auto &os = *options.report;
+        os << "{\"input_bytes\": " << stats.input_file_size << ", \"output_bytes\": " << stats.output_content_size
+           << ", \"header_bytes\": " << stats.additional_content_size
+           << ", \"ratio\": " << (raw_size != 0 ? double(compressed_size) / double(raw_size) : 0.0)
+           << ", \"seconds\": " << seconds
+           << ", \"bytes_per_second\": " << (seconds > 0 ? double(raw_size) / seconds : 0.0)
+           << ", \"allocations\": " << allocation_count() - options.allocations;
+        if (metrics != nullptr) {
+            os << ", \"entropy\": " << metrics->entropy << ", \"average_code_length\": " << metrics->average_code_length
+               << ", \"encoder_bytes_per_second\": " << metrics->bytes_per_second()
+               << ", \"encoder_allocations\": " << metrics->allocations << ", \"phase_seconds\": {";
+            for (size_t phase = 0; phase < encoder_metrics::PHASES_COUNT; ++phase) {
+                os << (phase != 0 ? ", " : "") << '"' << encoder_metrics::PHASE_NAMES[phase] << "\": "
+                   << std::chrono::duration<double>(metrics->times[phase]).count();
+            }
+            os << "}";
+        }
+        os << "}" << std::endl;
+    }
+
+    // Phases are known only for the single table layouts, the other codecs report the rest.
+    void report(const statistic &stats, const codec_options &options, const encoder_metrics *metrics = nullptr) {
+        if (options.is_json_report)
+            write_json(stats, options, metrics);
+        else
+            *options.report << stats << std::endl;
+    }
 
-        std::cout << encoder.stats << std::endl;
+    // The buffer has to be installed before the file is opened to take effect.
+    std::ostream &open_output(std::ofstream &output_stream, std::vector<char> &buffer, const std::string &output_file) {
+        if (output_file == STANDARD_STREAM)
+            return std::cout;
 
-        if (is_verbose)
-            verbose(encoder.tree);
+        buffer.resize(OUTPUT_BUFFER_SIZE);
+        output_stream.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+        output_stream.open(output_file, std::ios::binary);
+        if (!output_stream)
+            throw std::system_error(errno, std::generic_category(), output_file);
+        return output_stream;
+    }
+
+    void compress_mapped(const mapped_file &input, std::ostream &output_stream, const codec_options &options) {
+        if (options.format == format_version::adaptive) {
+            adaptive_encoder encoder(options.adaptive);
+            encoder.encode(input.data(), input.size(), output_stream);
+            report(encoder.stats, options);
+            return;
+        }
+        if (options.format == format_version::order1) {
+            order1_encoder encoder(input.data(), input.size(), options.blocks.max_code_length);
+            encoder.encode(input.data(), input.size(), output_stream);
+            report(encoder.stats, options);
+            return;
+        }
+        if (options.format == format_version::lz77) {
+            lz77_encoder encoder(options.lz77);
+            encoder.encode(input.data(), input.size(), output_stream);
+            report(encoder.stats, options);
+            return;
+        }
+        if (options.format == format_version::blocks) {
+            block_encoder encoder(options.blocks);
+            encoder.encode(input.data(), input.size(), output_stream);
+            report(encoder.stats, options);
+            return;
+        }
+
+        huffman_encoder encoder(input.data(), input.size(), options.format, options.blocks.max_code_length);
+        encoder.index_block_size = options.index_block_size;
+        encoder.encode(input.data(), input.size(), output_stream);
+
+        report(encoder.stats, options, &encoder.metrics);
+
+        if (options.is_verbose)
+            verbose(encoder.build_codes(), *options.report);
+    }
+
+    // Pipes can be read only once, so their input is encoded block by block as it arrives instead of
+    // counting the whole input before coding it.
+    void compress_stream(std::istream &input_stream, std::ostream &output_stream, const codec_options &options) {
+        if (options.format == format_version::legacy)
+            throw std::invalid_argument("the legacy layout needs a regular input file");
+        if (options.format == format_version::order1)
+            throw std::invalid_argument("the order-1 layout needs a regular input file");
+        if (options.format == format_version::indexed)
+            throw std::invalid_argument("the indexed layout needs a regular input file");
+        if (options.format == format_version::lz77)
+            throw std::invalid_argument("the LZ77 layout needs a regular input file");
+        if (options.format == format_version::adaptive) {
+            adaptive_encoder encoder(options.adaptive);
+            encoder.encode(input_stream, output_stream);
+            report(encoder.stats, options);
+            return;
+        }
+
+        block_encoder encoder(options.blocks);
+        encoder.encode(input_stream, output_stream);
+        report(encoder.stats, options);
     }
 
-    void make_decompress(const std::string &input_file, const std::string &output_file, bool is_verbose) {
+    std::ifstream open_input(const std::string &input_file) {
         std::ifstream input_stream(input_file, std::ios::binary);
+        if (!input_stream)
+            throw std::system_error(errno, std::generic_category(), input_file);
         input_stream >> std::noskipws;
+        return input_stream;
+    }
+
+    // Calls `f` with the whole input in memory, dictionary streams are meant for short messages.
+    template<typename F>
+    void with_input(const std::string &input_file, F &&f) {
+        if (input_file != STANDARD_STREAM && mapped_file::is_mappable(input_file)) {
+            const mapped_file input(input_file);
+            f(input.data(), input.size());
+            return;
+        }
+
+        std::vector<uint8_t> content;
+        if (input_file == STANDARD_STREAM) {
+            content.assign(std::istreambuf_iterator<char>(std::cin), {});
+        } else {
+            auto input_stream = open_input(input_file);
+            content.assign(std::istreambuf_iterator<char>(input_stream), {});
+        }
+        f(content.data(), content.size());
+    }
+
+    void compress_with_dictionary(const std::string &input_file, std::ostream &output_stream,
+                                  const codec_options &options) {
+        with_input(input_file, [&](const uint8_t *data, size_t size) {
+            huffman_context context;
+            std::vector<uint8_t> output(huffman_context::max_compressed_size(size, *options.dictionary));
+            output.resize(context.compress(data, size, output.data(), output.size(), *options.dictionary));
+            output_stream.write(reinterpret_cast<const char *>(output.data()), output.size());
+            report(context.stats, options);
+        });
+    }
+
+    void decompress_with_dictionary(const std::string &input_file, std::ostream &output_stream,
+                                    const codec_options &options) {
+        with_input(input_file, [&](const uint8_t *data, size_t size) {
+            huffman_context context;
+            std::vector<uint8_t> output(huffman_context::decompressed_size(data, size));
+            output.resize(context.decompress(data, size, output.data(), output.size(), *options.dictionary));
+            output_stream.write(reinterpret_cast<const char *>(output.data()), output.size());
+            report(context.stats, options);
+        });
+    }
+
+    void compress_pipelined(std::istream &input_stream, std::ostream &output_stream, const codec_options &options) {
+        block_encoder encoder(options.blocks);
+        encoder.encode_pipelined(input_stream, output_stream);
+        report(encoder.stats, options);
+    }
 
-        std::ofstream output_stream(output_file, std::ios::binary);
+    void make_compress(const std::string &input_file, const std::string &output_file, const codec_options &options) {
+        std::vector<char> buffer;
+        std::ofstream output_file_stream;
+        auto &output_stream = open_output(output_file_stream, buffer, output_file);
 
-        huffman_decoder decoder(input_stream);
+        if (options.is_pipelined && input_file == STANDARD_STREAM) {
+            compress_pipelined(std::cin, output_stream, options);
+        } else if (options.is_pipelined) {
+            auto input_stream = open_input(input_file);
+            compress_pipelined(input_stream, output_stream, options);
+        } else if (options.dictionary) {
+            compress_with_dictionary(input_file, output_stream, options);
+        } else if (input_file == STANDARD_STREAM) {
+            compress_stream(std::cin, output_stream, options);
+        } else if (mapped_file::is_mappable(input_file)) {
+            compress_mapped(mapped_file(input_file), output_stream, options);
+        } else {
+            auto input_stream = open_input(input_file);
+            compress_stream(input_stream, output_stream, options);
+        }
+        output_stream.flush();
+    }
 
+    void decompress(huffman_decoder &decoder, std::ostream &output_stream, const codec_options &options) {
         decoder.decode(output_stream);
+        output_stream.flush();
 
-        std::cout << decoder.stats << std::endl;
+        report(decoder.stats, options);
 
-        if (is_verbose)
-            verbose(decoder.tree);
+        if (options.is_verbose && !is_block_format(decoder.format))
+            verbose(decoder.codes, *options.report);
+    }
+
+    void decompress_range(const std::string &input_file, std::ostream &output_stream, const codec_options &options) {
+        with_input(input_file, [&](const uint8_t *data, size_t size) {
+            huffman_decoder decoder(data, size);
+            decoder.decode_range(options.range->first, options.range->second, output_stream);
+            output_stream.flush();
+            report(decoder.stats, options);
+        });
+    }
+
+    void make_decompress(const std::string &input_file, const std::string &output_file, const codec_options &options) {
+        std::vector<char> buffer;
+        std::ofstream output_file_stream;
+        auto &output_stream = open_output(output_file_stream, buffer, output_file);
+
+        if (options.range) {
+            decompress_range(input_file, output_stream, options);
+        } else if (options.dictionary) {
+            decompress_with_dictionary(input_file, output_stream, options);
+            output_stream.flush();
+        } else if (input_file == STANDARD_STREAM) {
+            huffman_decoder decoder(std::cin, decoding_engine::table, options.blocks.threads);
+            decompress(decoder, output_stream, options);
+        } else if (mapped_file::is_mappable(input_file)) {
+            const mapped_file input(input_file);
+            huffman_decoder decoder(input.data(), input.size(), decoding_engine::table, options.blocks.threads);
+            decompress(decoder, output_stream, options);
+        } else {
+            auto input_stream = open_input(input_file);
+            huffman_decoder decoder(input_stream, decoding_engine::table, options.blocks.threads);
+            decompress(decoder, output_stream, options);
+        }
+    }
+
+    // Subcommands take their options out of the tokens, what is left are their operands.
+    std::optional<std::string> take_option(std::vector<std::string> &tokens, const std::string &name,
+                                           const std::string &value_name) {
+        const auto option = std::find(tokens.begin(), tokens.end(), name);
+        if (option == tokens.end())
+            return {};
+        if (std::next(option) == tokens.end())
+            throw std::invalid_argument(name + " needs the " + value_name);
+        auto value = *std::next(option);
+        tokens.erase(option, std::next(option, 2));
+        return value;
+    }
+
+    // Zero threads run the work on one.
+    size_t parse_threads(const std::string &value) {
+        return static_cast<size_t>(parse_number(value, "-j", block_options::MAX_THREADS));
+    }
+
+    // Sizes are given in kilobytes and their bytes have to fit size_t.
+    uint64_t parse_kilobytes(const std::string &value, const std::string &name) {
+        return parse_number(value, name, SIZE_MAX >> 10u) << 10u;
+    }
+
+    // Limits above the longest code are as good as none, the codecs reject the ones below the shortest.
+    uint8_t parse_code_length_limit(const std::string &value) {
+        return static_cast<uint8_t>(std::min<uint64_t>(parse_number(value, "-L"), UINT8_MAX));
+    }
+
+    // `train [-L bits] dictionary sample...` counts the samples together into a dictionary.
+    void make_train(std::vector<std::string> tokens) {
+        uint8_t max_code_length = huffman_tree::MAX_CODE_LENGTH;
+        if (auto bits = take_option(tokens, "-L", "number of bits"))
+            max_code_length = parse_code_length_limit(*bits);
+        if (tokens.size() < 2)
+            throw std::invalid_argument("train needs a dictionary and at least one sample");
+
+        huffman_tree::char_counter counter{};
+        for (auto sample = std::next(tokens.begin()); sample != tokens.end(); ++sample) {
+            with_input(*sample, [&](const uint8_t *data, size_t size) {
+                const auto sample_counter = count_characters(data, size);
+                for (size_t character = 0; character < counter.size(); ++character)
+                    counter[character] += sample_counter[character];
+            });
+        }
+
+        const auto dictionary = huffman_dictionary::train(counter, max_code_length);
+        std::ofstream output_stream(tokens.front(), std::ios::binary);
+        if (!output_stream)
+            throw std::system_error(errno, std::generic_category(), tokens.front());
+        dictionary.save(output_stream);
+        std::cout << dictionary.id() << std::endl;
+    }
+
+    // `archive [-j threads] [-b kilobytes] [-L bits] archive path...` compresses files and directories
+    // into a single archive.
+    void make_archive(std::vector<std::string> tokens) {
+        block_options options;
+        if (auto threads = take_option(tokens, "-j", "number of threads"))
+            options.threads = parse_threads(*threads);
+        if (auto block_size = take_option(tokens, "-b", "block size"))
+            options.block_size = parse_kilobytes(*block_size, "-b");
+        if (auto bits = take_option(tokens, "-L", "number of bits"))
+            options.max_code_length = parse_code_length_limit(*bits);
+        if (tokens.size() < 2)
+            throw std::invalid_argument("archive needs an archive and at least one path");
+
+        archive_writer writer(options);
+        for (auto path = std::next(tokens.begin()); path != tokens.end(); ++path)
+            writer.add(*path);
+
+        std::vector<char> buffer;
+        std::ofstream output_file_stream;
+        auto &output_stream = open_output(output_file_stream, buffer, tokens.front());
+        writer.write(output_stream);
+        output_stream.flush();
+        (tokens.front() == STANDARD_STREAM ? std::cerr : std::cout) << writer.stats << std::endl;
+    }
+
+    // `extract [-j threads] archive directory [member...]` writes every member or the named ones below
+    // the directory, `list archive` prints the size, compressed size and name of every member.
+    void make_extract(std::vector<std::string> tokens, bool is_listing) {
+        size_t threads = std::thread::hardware_concurrency();
+        if (auto value = take_option(tokens, "-j", "number of threads"))
+            threads = parse_threads(*value);
+        if (is_listing && tokens.size() != 1)
+            throw std::invalid_argument("list needs an archive");
+        if (!is_listing && tokens.size() < 2)
+            throw std::invalid_argument("extract needs an archive and a directory");
+
+        with_input(tokens.front(), [&](const uint8_t *data, size_t size) {
+            const archive_reader archive(data, size);
+            if (is_listing) {
+                for (const auto &member: archive.members())
+                    std::cout << member.size << " " << member.compressed_size << " " << member.name << std::endl;
+                return;
+            }
+
+            std::vector<const archive_member *> members;
+            for (auto name = std::next(tokens.begin(), 2); name != tokens.end(); ++name) {
+                const auto *member = archive.find(*name);
+                if (member == nullptr)
+                    throw std::invalid_argument("the archive has no member " + *name);
+                members.push_back(member);
+            }
+            if (tokens.size() == 2) {
+                for (const auto &member: archive.members())
+                    members.push_back(&member);
+            }
+            std::cout << extract_members(archive, members, tokens[1], threads) << std::endl;
+        });
+    }
+
+    // `--range start:length` has a long name, which the single character arguments do not parse.
+    std::optional<std::pair<uint64_t, uint64_t>> parse_range(const std::vector<std::string> &tokens) {
+        const auto range = std::find(tokens.begin(), tokens.end(), "--range");
+        if (range == tokens.end())
+            return {};
+        if (std::next(range) == tokens.end())
+            throw std::invalid_argument("--range needs start:length");
+
+        const auto &value = *std::next(range);
+        const auto separator = value.find(':');
+        if (separator == std::string::npos)
+            throw std::invalid_argument("--range needs start:length");
+        return std::make_pair(parse_number(value.substr(0, separator), "--range"),
+                              parse_number(value.substr(separator + 1), "--range"));
+    }
+
+    huffman_dictionary load_dictionary(const std::string &dictionary_file) {
+        auto input_stream = open_input(dictionary_file);
+        return huffman_dictionary::load(input_stream);
     }
 
     void print_usage(const std::string &name, std::ostream &os) {
         os << "Usage:" << std::endl;
-        os << "\t" << name << " [-v] -d source destination" << std::endl;
-        os << "\t" << name << " [-v] -c source destination" << std::endl;
+        os << "\t" << name << " [-v] [-j threads] [-D dictionary] -d source destination" << std::endl;
+        os << "\t" << name << " --range start:length -d source destination" << std::endl;
+        os << "\t" << name << " [-v] [-l | -i | -1 | -b kilobytes | -a kilobytes | -s kilobytes | -z level]"
+           << " [-L bits] [-j threads] -c source destination" << std::endl;
+        os << "\t" << name << " -P depth [-b kilobytes] [-L bits] [-j threads] -c source destination" << std::endl;
+        os << "\t" << name << " -D dictionary -c source destination" << std::endl;
+        os << "\t" << name << " train [-L bits] dictionary sample..." << std::endl;
+        os << "\t" << name << " archive [-j threads] [-b kilobytes] [-L bits] archive path..." << std::endl;
+        os << "\t" << name << " extract [-j threads] archive directory [member...]" << std::endl;
+        os << "\t" << name << " list archive" << std::endl;
+        os << "\t-l\twrite the legacy layout with 256 frequencies instead of canonical code lengths" << std::endl;
+        os << "\t-i\tdeal the codes to 4 interleaved bitstreams that decode in lockstep" << std::endl;
+        os << "\t-1\tcode every byte with a table chosen by the byte before it" << std::endl;
+        os << "\t-b\tsplit the input into independent blocks of the given size" << std::endl;
+        os << "\t-s\tindex blocks of the given size, so --range decodes only the blocks it covers" << std::endl;
+        os << "\t-P\tread, encode and write blocks on separate threads, reading up to the given number of"
+           << " blocks ahead" << std::endl;
+        os << "\t-a\tadapt the codes to the data coded so far, rebuilding them every given kilobytes" << std::endl;
+        os << "\t-z\tfind LZ77 matches with the given effort from 1 to 9 and code them per block, 6 is the default"
+           << std::endl;
+        os << "\t-L\tlimit code lengths to the given number of bits, from 8 to 64" << std::endl;
+        os << "\t-j\tnumber of threads encoding or decoding blocks" << std::endl;
+        os << "\t-D\tcode with a dictionary made by train, the stream names it instead of storing codes" << std::endl;
+        os << "\t--stats=json\treport sizes, throughput, allocations, entropy and encoder phases as JSON" << std::endl;
+        os << "\tA source or destination of - stands for stdin or stdout, input that is not a regular file" << std::endl;
+        os << "\tis compressed in a single pass into blocks" << std::endl;
     }
 }
 
 int main(int argc, char **argv) {
+    std::ios::sync_with_stdio(false);
+    set_allocation_counter(allocation_count);
+
     program_arguments arguments(argc, argv, print_usage);
     optional_cli_argument verbose('v');
+    optional_cli_argument legacy('l');
+    optional_cli_argument interleaved('i');
+    optional_cli_argument order1('1');
+    char_cli_argument blocks('b', 1);
+    char_cli_argument adaptive('a', 1);
+    char_cli_argument indexed('s', 1);
+    char_cli_argument lz77('z', 1);
+    char_cli_argument pipelined('P', 1);
+    char_cli_argument max_code_length('L', 1);
+    char_cli_argument threads('j', 1);
+    char_cli_argument dictionary('D', 1);
     char_cli_argument compress('c', 2);
     char_cli_argument decompress('d', 2);
+    // Each picks the layout. -P writes blocks, so it goes with -b and checks the rest itself.
+    const std::array<const cli_argument *, 7> format_arguments = {&legacy, &interleaved, &order1, &blocks, &adaptive,
+                                                                  &indexed, &lz77};
 
     auto compress_option = arguments.option_for(compress);
     auto decompress_option = arguments.option_for(decompress);
-    auto verbose_option = arguments.option_for(verbose);
-
-    if (compress_option) {
-        auto input_file = compress_option->arguments[0];
-        auto output_file = compress_option->arguments[1];
-        make_compress(input_file, output_file, verbose_option.has_value());
-    } else if (decompress_option) {
-        auto input_file = decompress_option->arguments[0];
-        auto output_file = decompress_option->arguments[1];
-        make_decompress(input_file, output_file, verbose_option.has_value());
-    } else {
+
+    codec_options options;
+    try {
+        const auto tokens = arguments.tokens();
+        if (!tokens.empty() && tokens.front() == "train") {
+            make_train(std::vector(std::next(tokens.begin()), tokens.end()));
+            return 0;
+        }
+        if (!tokens.empty() && tokens.front() == "archive") {
+            make_archive(std::vector(std::next(tokens.begin()), tokens.end()));
+            return 0;
+        }
+        if (!tokens.empty() && (tokens.front() == "extract" || tokens.front() == "list")) {
+            make_extract(std::vector(std::next(tokens.begin()), tokens.end()), tokens.front() == "list");
+            return 0;
+        }
+
+        options.is_verbose = arguments.option_for(verbose).has_value();
+        const auto formats = std::count_if(format_arguments.begin(), format_arguments.end(), [&](const auto *format) {
+            return arguments.option_for(*format).has_value();
+        });
+        if (formats > 1)
+            throw std::invalid_argument("-l, -i, -1, -b, -a, -s and -z each choose the layout, give at most one");
+        if (arguments.option_for(legacy))
+            options.format = format_version::legacy;
+        if (arguments.option_for(interleaved))
+            options.format = format_version::interleaved;
+        if (arguments.option_for(order1))
+            options.format = format_version::order1;
+        if (auto option = arguments.option_for(blocks)) {
+            options.format = format_version::blocks;
+            options.blocks.block_size = parse_kilobytes(option->arguments[0], "-b");
+        }
+        if (auto option = arguments.option_for(adaptive)) {
+            options.format = format_version::adaptive;
+            options.adaptive.rebuild_interval = parse_kilobytes(option->arguments[0], "-a");
+        }
+        if (auto option = arguments.option_for(indexed)) {
+            options.format = format_version::indexed;
+            options.index_block_size = parse_kilobytes(option->arguments[0], "-s");
+            if (options.index_block_size == 0)
+                throw std::invalid_argument("-s needs a positive block size");
+        }
+        if (auto option = arguments.option_for(lz77)) {
+            options.format = format_version::lz77;
+            const auto level = parse_number(option->arguments[0], "-z");
+            options.lz77.level = static_cast<uint8_t>(std::min<uint64_t>(level, UINT8_MAX));
+        }
+        if (auto option = arguments.option_for(pipelined)) {
+            if (options.format != format_version::canonical && options.format != format_version::blocks)
+                throw std::invalid_argument("-P writes blocks and does not combine with -l, -i, -1, -a, -s or -z");
+            options.format = format_version::blocks;
+            options.is_pipelined = true;
+            options.blocks.queue_depth = parse_number(option->arguments[0], "-P", block_options::MAX_QUEUE_DEPTH);
+        }
+        if (auto option = arguments.option_for(max_code_length)) {
+            options.blocks.max_code_length = parse_code_length_limit(option->arguments[0]);
+            options.adaptive.max_code_length = options.blocks.max_code_length;
+            options.lz77.max_code_length = options.blocks.max_code_length;
+        }
+        if (auto option = arguments.option_for(threads))
+            options.blocks.threads = parse_threads(option->arguments[0]);
+        if (auto option = arguments.option_for(dictionary)) {
+            if (options.format != format_version::canonical || options.is_verbose)
+                throw std::invalid_argument("-D does not combine with -l, -i, -1, -b, -a, -s, -z, -P or -v");
+            options.dictionary = load_dictionary(option->arguments[0]);
+        }
+        options.range = parse_range(tokens);
+        options.is_json_report = std::find(tokens.begin(), tokens.end(), "--stats=json") != tokens.end();
+        if (options.is_json_report && options.is_verbose)
+            throw std::invalid_argument("--stats=json does not combine with -v");
+        if (options.range && (options.dictionary || options.is_verbose))
+            throw std::invalid_argument("--range does not combine with -D or -v");
+
+        if (compress_option) {
+            auto input_file = compress_option->arguments[0];
+            auto output_file = compress_option->arguments[1];
+            if (output_file == STANDARD_STREAM)
+                options.report = &std::cerr;
+            options.is_compressing = true;
+            options.started = std::chrono::steady_clock::now();
+            options.allocations = allocation_count();
+            make_compress(input_file, output_file, options);
+        } else if (decompress_option) {
+            auto input_file = decompress_option->arguments[0];
+            auto output_file = decompress_option->arguments[1];
+            if (output_file == STANDARD_STREAM)
+                options.report = &std::cerr;
+            options.started = std::chrono::steady_clock::now();
+            options.allocations = allocation_count();
+            make_decompress(input_file, output_file, options);
+        } else {
+            arguments.print_usage(std::cerr);
+        }
+    } catch (const huffman_format_error &error) {
+        std::cerr << "Corrupted input: " << error.what() << std::endl;
+        return 1;
+    } catch (const std::system_error &error) {
+        std::cerr << "I/O error: " << error.what() << std::endl;
+        return 1;
+    } catch (const std::invalid_argument &error) {
+        std::cerr << "Invalid argument: " << error.what() << std::endl;
         arguments.print_usage(std::cerr);
+        return 1;
+    } catch (const std::bad_alloc &) {
+        std::cerr << "Out of memory" << std::endl;
+        return 1;
+    } catch (const std::length_error &error) {
+        std::cerr << "Too large: " << error.what() << std::endl;
+        return 1;
     }
 }
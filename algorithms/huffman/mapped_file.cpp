@@ -0,0 +1,45 @@
+#include "mapped_file.hpp"
+
+#include <cerrno>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+mapped_file::mapped_file(const std::string &path) {
+    const int descriptor = ::open(path.c_str(), O_RDONLY);
+    if (descriptor < 0)
+        throw std::system_error(errno, std::generic_category(), path);
+
+    struct stat status{};
+    if (::fstat(descriptor, &status) < 0) {
+        const auto error = errno;
+        ::close(descriptor);
+        throw std::system_error(error, std::generic_category(), path);
+    }
+
+    _size = static_cast<size_t>(status.st_size);
+    if (_size != 0) {
+        void *address = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if (address == MAP_FAILED) {
+            const auto error = errno;
+            ::close(descriptor);
+            throw std::system_error(error, std::generic_category(), path);
+        }
+        ::madvise(address, _size, MADV_SEQUENTIAL);
+        _data = static_cast<const uint8_t *>(address);
+    }
+    ::close(descriptor);
+}
+
+mapped_file::~mapped_file() {
+    if (_data != nullptr)
+        ::munmap(const_cast<uint8_t *>(_data), _size);
+}
+
+bool mapped_file::is_mappable(const std::string &path) {
+    struct stat status{};
+    return ::stat(path.c_str(), &status) == 0 && S_ISREG(status.st_mode);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Read-only memory mapping of a whole regular file.
+class mapped_file final {
+public:
+    explicit mapped_file(const std::string &path);
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    ~mapped_file();
+
+    [[nodiscard]] const uint8_t *data() const noexcept { return _data; }
+
+    [[nodiscard]] size_t size() const noexcept { return _size; }
+
+    // Pipes, terminals and other special files can not be mapped and go through streams.
+    [[nodiscard]] static bool is_mappable(const std::string &path);
+
+private:
+    const uint8_t *_data = nullptr;
+    size_t _size = 0;
+};
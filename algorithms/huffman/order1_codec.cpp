@@ -0,0 +1,141 @@
+#include "order1_codec.hpp"
+
+#include <algorithm>
+#include <vector>
+
+namespace {
+    constexpr auto CONTEXTS_COUNT = huffman_tree::CHARACTERS_COUNT;
+
+    void add(huffman_tree::char_counter &to, const huffman_tree::char_counter &counter) {
+        for (size_t symbol = 0; symbol < counter.size(); ++symbol)
+            to[symbol] += counter[symbol];
+    }
+}
+
+// Contexts are weighed against a shared table of all of them, those that save more with an own table
+// than it costs to store leave, and the shared table is rebuilt from the ones that stay.
+order1_tables plan_order1_tables(const uint8_t *data, size_t size, uint8_t max_code_length) {
+    std::vector<huffman_tree::char_counter> counts(CONTEXTS_COUNT);
+    huffman_tree::char_counter total{};
+    uint8_t context = 0;
+    for (const auto *end = data + size; data != end; context = *data++)
+        ++counts[context][*data];
+    for (const auto &counter : counts)
+        add(total, counter);
+
+    const auto total_lengths = build_code_lengths(total, max_code_length);
+    std::vector<uint8_t> own_contexts;
+    order1_tables tables;
+    huffman_tree::char_counter shared{};
+    for (size_t index = 0; index < CONTEXTS_COUNT; ++index) {
+        const auto &counter = counts[index];
+        if (std::all_of(counter.begin(), counter.end(), [](uint64_t count) { return count == 0; }))
+            continue;
+
+        auto lengths = build_code_lengths(counter, max_code_length);
+        // The context byte goes into the header along with the code lengths.
+        const auto header_bits = (code_lengths_header_size(lengths) + 1) * 8;
+        if (coded_bits(counter, lengths) + header_bits < coded_bits(counter, total_lengths)) {
+            own_contexts.push_back(static_cast<uint8_t>(index));
+            tables.lengths.push_back(lengths);
+        } else {
+            add(shared, counter);
+        }
+    }
+
+    tables.own_tables = own_contexts.size();
+    tables.context_table.fill(static_cast<uint8_t>(tables.own_tables));
+    for (size_t table = 0; table < tables.own_tables; ++table)
+        tables.context_table[own_contexts[table]] = static_cast<uint8_t>(table);
+    if (tables.own_tables < CONTEXTS_COUNT)
+        tables.lengths.push_back(build_code_lengths(shared, max_code_length));
+    return tables;
+}
+
+void append_order1_tables(std::vector<uint8_t> &output, const order1_tables &tables) {
+    append_varint(output, tables.own_tables);
+    for (size_t context = 0; context < CONTEXTS_COUNT; ++context) {
+        if (tables.context_table[context] < tables.own_tables)
+            output.push_back(static_cast<uint8_t>(context));
+    }
+    for (const auto &lengths : tables.lengths)
+        append_code_lengths(output, lengths);
+}
+
+order1_tables read_order1_tables(const uint8_t *&data, const uint8_t *end) {
+    const auto own_tables = read_varint(data, end);
+    if (own_tables > CONTEXTS_COUNT || own_tables > uint64_t(end - data))
+        throw huffman_format_error("invalid context tables");
+
+    order1_tables tables;
+    tables.own_tables = own_tables;
+    tables.context_table.fill(static_cast<uint8_t>(own_tables));
+    for (uint64_t table = 0; table < own_tables; ++table) {
+        const auto context = *data++;
+        if (table != 0 && context <= *(data - 2))
+            throw huffman_format_error("invalid context tables");
+        tables.context_table[context] = static_cast<uint8_t>(table);
+    }
+
+    const auto tables_count = own_tables < CONTEXTS_COUNT ? own_tables + 1 : own_tables;
+    for (uint64_t table = 0; table < tables_count; ++table)
+        tables.lengths.push_back(read_code_lengths(data, end));
+    return tables;
+}
+
+order1_encoder::order1_encoder(const uint8_t *data, size_t size, uint8_t max_code_length)
+    : tables(plan_order1_tables(data, size, max_code_length)) {
+    stats.input_file_size = size;
+}
+
+void order1_encoder::encode(const uint8_t *data, size_t size, std::ostream &output_stream) {
+    bit_writer header_writer(output_stream, stats);
+    header_writer.write_header(format_version::order1);
+    header_writer.write_varint(size);
+
+    std::vector<uint8_t> output;
+    append_order1_tables(output, tables);
+    output_stream.write(reinterpret_cast<const char *>(output.data()), output.size());
+    stats.additional_content_size += output.size();
+    output.clear();
+
+    std::vector<huffman_tree::code_table> codes;
+    for (const auto &lengths : tables.lengths)
+        codes.push_back(make_canonical_codes(lengths));
+    std::array<const huffman_code *, CONTEXTS_COUNT> context_codes{};
+    for (size_t context = 0; context < CONTEXTS_COUNT; ++context)
+        context_codes[context] = codes[tables.context_table[context]].data();
+
+    word_bit_writer writer(output);
+    uint8_t context = 0;
+    for (const auto *end = data + size; data != end;) {
+        const auto *chunk_end = data + std::min<size_t>(end - data, huffman_encoder::INPUT_BUFFER_SIZE);
+        for (; data != chunk_end; context = *data++)
+            writer.write(context_codes[context][*data]);
+        stats.output_content_size += writer.flush(output_stream);
+    }
+
+    writer.finish();
+    stats.output_content_size += writer.flush(output_stream);
+}
+
+order1_decoder::order1_decoder(const order1_tables &tables) {
+    _tables.reserve(tables.lengths.size());
+    for (const auto &lengths : tables.lengths)
+        _tables.emplace_back(make_canonical_codes(lengths));
+
+    for (size_t context = 0; context < CONTEXTS_COUNT; ++context) {
+        const auto &table = _tables[tables.context_table[context]];
+        _context_tables[context] = table.empty() ? nullptr : &table;
+    }
+}
+
+// The next table depends on the symbol just decoded, so entries are taken one symbol at a time.
+void order1_decoder::decode(word_bit_reader &bits, uint8_t *output, size_t count) {
+    for (const auto *end = output + count; output != end; ++output) {
+        const auto *table = _context_tables[_context];
+        if (table == nullptr)
+            throw huffman_format_error("invalid huffman code");
+        _context = *output = table->decode_symbol(bits);
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "huffman.hpp"
+
+#include <array>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+// Order-1 layout: every symbol is coded with the table of its context, the byte before it (zero for
+// the first one). A context gets its own table only when that saves more than the table costs in the
+// header, the sparse rest share a table built from all of them. After the symbols count the header
+// lists the contexts with own tables, then the code lengths of their tables and of the shared one.
+struct order1_tables {
+    // Index into `lengths` for every context.
+    std::array<uint8_t, huffman_tree::CHARACTERS_COUNT> context_table{};
+    // Own tables in the order of their contexts, then the shared one unless every context has its own.
+    std::vector<huffman_tree::code_lengths> lengths;
+    size_t own_tables = 0;
+};
+
+order1_tables plan_order1_tables(const uint8_t *data, size_t size,
+                                 uint8_t max_code_length = huffman_tree::MAX_CODE_LENGTH);
+void append_order1_tables(std::vector<uint8_t> &output, const order1_tables &tables);
+// Throws huffman_format_error for tables no encoder writes.
+order1_tables read_order1_tables(const uint8_t *&data, const uint8_t *end);
+
+class order1_encoder final {
+public:
+    // Counts the pairs of bytes, the whole input has to be at hand.
+    order1_encoder(const uint8_t *data, size_t size, uint8_t max_code_length = huffman_tree::MAX_CODE_LENGTH);
+
+    void encode(const uint8_t *data, size_t size, std::ostream &output_stream);
+
+    statistic stats;
+    order1_tables tables;
+};
+
+class order1_decoder final {
+public:
+    explicit order1_decoder(const order1_tables &tables);
+
+    // Continues with the context the previous call ended in.
+    void decode(word_bit_reader &bits, uint8_t *output, size_t count);
+
+private:
+    std::vector<decode_table> _tables;
+    // Null for contexts whose table has no codes, only corrupted streams reach them.
+    std::array<const decode_table *, huffman_tree::CHARACTERS_COUNT> _context_tables{};
+    uint8_t _context = 0;
+};
@@ -23,10 +23,123 @@ run()
     return $?
 }
 
+# Every compression mode is round-tripped, the empty one is the default.
+for options in "" "-l" "-b 1 -j 3" "-b 64" "-L 8" "-b 4 -L 9" "-i" "-i -L 8" "-a 1" "-a 64 -L 9" "-1" "-1 -L 8" "-s 1" "-s 64 -L 9" "-z 1" "-z 6" "-z 9 -L 9" "-P 1 -b 1" "-P 4 -b 4 -j 3"; do
+    for source_file in *.in; do
+        run $options -c $source_file $COMPRESSED_FILE
+        run -d $COMPRESSED_FILE $DECOMPRESSED_FILE
+        diff -q $source_file $DECOMPRESSED_FILE
+    done
+done
+
+# Pipes are compressed in a single pass, into blocks or adaptively, and both ends stream through stdin and stdout.
+for source_file in *.in; do
+    echo "***** Running: $EXECUTABLE -c - - < $source_file | $EXECUTABLE -d - -"
+    $REAL_EXEC -c - - < $source_file 2>/dev/null | $REAL_EXEC -d - - > $DECOMPRESSED_FILE 2>/dev/null
+    diff -q $source_file $DECOMPRESSED_FILE
+    $REAL_EXEC -a 4 -c - - < $source_file 2>/dev/null | $REAL_EXEC -d - - > $DECOMPRESSED_FILE 2>/dev/null
+    diff -q $source_file $DECOMPRESSED_FILE
+    $REAL_EXEC -P 2 -b 1 -c - - < $source_file 2>/dev/null | $REAL_EXEC -d - - > $DECOMPRESSED_FILE 2>/dev/null
+    diff -q $source_file $DECOMPRESSED_FILE
+done
+
+# The JSON report still decodes to the same content and names every phase of the encoder.
+run --stats=json -c pg16527.in $COMPRESSED_FILE > stats.json
+grep -q '"entropy": .*"phase_seconds": {"histogram": .*"flush": ' stats.json
+run --stats=json -d $COMPRESSED_FILE $DECOMPRESSED_FILE > stats.json
+grep -q '"bytes_per_second": ' stats.json
+diff -q pg16527.in $DECOMPRESSED_FILE
+rm -f stats.json
+
+# Blocks the codes would not shrink are stored, so a uniform distribution grows only by the framing.
+run -b 64 -c 00_to_ff_2.in $COMPRESSED_FILE
+[ "$(wc -c < $COMPRESSED_FILE)" -le $(($(wc -c < 00_to_ff_2.in) + 32)) ]
+
+# Skewed blocks are coded with tANS, which beats the whole-bit codes of a single table.
+run -c fib.in $COMPRESSED_FILE
+CANONICAL_SIZE=$(wc -c < $COMPRESSED_FILE)
+run -b 1024 -c fib.in $COMPRESSED_FILE
+[ "$(wc -c < $COMPRESSED_FILE)" -lt $((CANONICAL_SIZE * 97 / 100)) ]
+run -d $COMPRESSED_FILE $DECOMPRESSED_FILE
+diff -q fib.in $DECOMPRESSED_FILE
+
+# Blocks carry checksums, a changed byte fails the decoding instead of changing the output.
+run -b 64 -c pg16527.in $COMPRESSED_FILE
+printf '\377' | dd of=$COMPRESSED_FILE bs=1 seek=100000 conv=notrunc 2>/dev/null
+if $REAL_EXEC -d $COMPRESSED_FILE $DECOMPRESSED_FILE 2>/dev/null; then
+    echo "A corrupted block was decoded"
+    exit 1
+fi
+
+# Options that pick different layouts, or more threads or queued blocks than allowed, are refused.
+for options in "-l -i" "-b 64 -z 6" "-s 1 -a 1" "-j 18446744073709551615" "-P 18446744073709551615"; do
+    STATUS=0
+    $REAL_EXEC $options -c pg16527.in $COMPRESSED_FILE 2>/dev/null || STATUS=$?
+    if [ $STATUS -ne 1 ]; then
+        echo "Options $options were not rejected"
+        exit 1
+    fi
+done
+
+# A header that announces symbols without a single code is rejected as corrupted, exit code 1, not decoded.
+printf '\211HUF\001\005\377\377\000\000\000\000' > $COMPRESSED_FILE
+STATUS=0
+$REAL_EXEC -d $COMPRESSED_FILE $DECOMPRESSED_FILE 2>/dev/null || STATUS=$?
+if [ $STATUS -ne 1 ]; then
+    echo "A header without codes was not rejected"
+    exit 1
+fi
+
+# So is a block frame that claims a 1 TiB payload in a stream of a few bytes.
+printf '\211HUF\002\200\200\200\200\200\040\200\200\200\200\200\040\200\200\200\200\200\040abc' > $COMPRESSED_FILE
+STATUS=0
+$REAL_EXEC -d $COMPRESSED_FILE $DECOMPRESSED_FILE 2>/dev/null || STATUS=$?
+if [ $STATUS -ne 1 ]; then
+    echo "A frame larger than the stream was not rejected"
+    exit 1
+fi
+
+# Ranges of an indexed stream start inside, at and across block boundaries and may run past the end.
+run -s 1 -c pg16527.in $COMPRESSED_FILE
+for range in 0:1 1000:24 1023:2 1024:1024 5000:70000 271300:100; do
+    run --range $range -d $COMPRESSED_FILE $DECOMPRESSED_FILE
+    tail -c +$((${range%:*} + 1)) pg16527.in | head -c ${range#*:} | cmp -s - $DECOMPRESSED_FILE
+done
+
+# A dictionary trained on one sample codes every file, the ones with bytes it never saw too.
+DICTIONARY_FILE=dictionary
+run train -L 12 $DICTIONARY_FILE pg16527.in
 for source_file in *.in; do
-    run -c $source_file $COMPRESSED_FILE
-    run -d $COMPRESSED_FILE $DECOMPRESSED_FILE
+    run -D $DICTIONARY_FILE -c $source_file $COMPRESSED_FILE
+    run -D $DICTIONARY_FILE -d $COMPRESSED_FILE $DECOMPRESSED_FILE
     diff -q $source_file $DECOMPRESSED_FILE
 done
+# Files without the dictionary format still decode through the same in-memory path, the legacy one too.
+run -l -c pg16527.in $COMPRESSED_FILE
+run -D $DICTIONARY_FILE -d $COMPRESSED_FILE $DECOMPRESSED_FILE
+diff -q pg16527.in $DECOMPRESSED_FILE
+rm -f $DICTIONARY_FILE
+
+# Archive members decode on their own, and a directory brings every file below it.
+ARCHIVE_FILE=archive
+EXTRACTED_DIRECTORY=extracted
+rm -rf $EXTRACTED_DIRECTORY ${EXTRACTED_DIRECTORY}_again
+run archive -j 3 -b 4 $ARCHIVE_FILE *.in
+run extract $ARCHIVE_FILE $EXTRACTED_DIRECTORY
+for source_file in *.in; do
+    diff -q $source_file $EXTRACTED_DIRECTORY/$source_file
+done
+rm -rf $EXTRACTED_DIRECTORY
+run extract -j 1 $ARCHIVE_FILE $EXTRACTED_DIRECTORY fib.in
+[ "$(ls $EXTRACTED_DIRECTORY)" = "fib.in" ]
+diff -q fib.in $EXTRACTED_DIRECTORY/fib.in
+# Empty directories hold no files and are left out.
+mkdir -p $EXTRACTED_DIRECTORY/nested/empty
+cp pg16527.in $EXTRACTED_DIRECTORY/nested/
+run archive $ARCHIVE_FILE $EXTRACTED_DIRECTORY
+[ "$($REAL_EXEC list $ARCHIVE_FILE | wc -l)" -eq 2 ]
+run extract $ARCHIVE_FILE ${EXTRACTED_DIRECTORY}_again
+diff -q $EXTRACTED_DIRECTORY/nested/pg16527.in ${EXTRACTED_DIRECTORY}_again/$EXTRACTED_DIRECTORY/nested/pg16527.in
+rm -rf $ARCHIVE_FILE $EXTRACTED_DIRECTORY ${EXTRACTED_DIRECTORY}_again
 
 echo "Smoke test passed!"
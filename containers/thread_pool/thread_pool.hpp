@@ -278,7 +278,11 @@ namespace utils {
         thread_pool &operator=(const thread_pool &&) = delete;
 
         ~thread_pool() {
-            _is_stopped.store(true);
+            {
+                // Set under the lock, otherwise a worker between its check and its wait misses the notification.
+                std::lock_guard _lock(_mutex);
+                _is_stopped.store(true);
+            }
             _cv.notify_all();
             for (auto &thread:_workers)
                 thread.second.join();